@@ -0,0 +1,577 @@
+#define KILO_BENCH
+#include "kilo.c"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+
+#define BENCH_ROWS 50
+#define BENCH_COLS 160
+#define BENCH_SYNTHETIC_MB 8
+#define BENCH_PIPE_LOW 4096
+#define BENCH_PIPE_CHUNK 32768
+#define BENCH_TYPING_KEYS 2000
+#define BENCH_PASTE_BYTES (64 * 1024)
+#define BENCH_NEWLINES 1000
+#define BENCH_SCROLL_PAGES 200
+#define BENCH_SEARCH_STEPS 200
+#define BENCH_SWITCHES 1000
+#define BENCH_LARGE_NEEDLE "kbench_needle"
+#define BENCH_MAX_SCRIPTS 16
+
+static FILE *bench_out;
+static int bench_input_fd = -1;
+static const char *bench_query = "return";
+static const char *bench_scripts[BENCH_MAX_SCRIPTS];
+static size_t bench_num_scripts;
+
+void bench_die(const char *str) {
+    perror(str);
+    exit(1);
+}
+
+size_t bench_pending() {
+    int pending = 0;
+    if (ioctl(STDIN_FILENO, FIONREAD, &pending) == -1) { bench_die("bench_pending :: ioctl"); }
+    return pending;
+}
+
+/* Replays a keystroke script through editor_process_keypress into the null sink. The
+ * script is pushed through the pipe in chunks that never split an escape sequence.
+ * Unpaced replays render after every key, as if each key arrived on its own; paced
+ * replays go through the frame pacer like a burst of input in the interactive loop. */
+void bench_feed(const char *keys, size_t len, bool paced) {
+    size_t off = 0;
+    while (off < len || bench_pending() > 0) {
+        if (off < len && bench_pending() < BENCH_PIPE_LOW) {
+            size_t chunk = len - off < BENCH_PIPE_CHUNK ? len - off : BENCH_PIPE_CHUNK;
+            if (off + chunk < len) {
+                for (size_t k = 1; k <= 3 && k < chunk; k++) {
+                    if (keys[off + chunk - k] == '\x1b') {
+                        chunk -= k;
+                        break;
+                    }
+                }
+            }
+
+            ssize_t written = write(bench_input_fd, &keys[off], chunk);
+            if (written == -1) { bench_die("bench_feed :: write"); }
+            off += written;
+        }
+
+        if (paced) {
+            editor_drain_input();
+            editor_render_if_due();
+        } else {
+            editor_process_keypress();
+            editor_refresh_screen();
+        }
+
+        editor_journal_tick();
+    }
+
+    if (editor_pacer.pending) { editor_refresh_screen(); }
+}
+
+/* Starts over with one empty buffer. Journaling is off, so the bench neither replays
+ * nor leaves a journal next to the corpora it edits. */
+void bench_reset() {
+    if (editor_cfg.buf != NULL) { editor_buffer_close(); }
+    editor_init_with_size(BENCH_ROWS, BENCH_COLS);
+    editor_cfg.buf->journal.failed = true;
+}
+
+void bench_begin() {
+    memset(editor_prof.hist, 0, sizeof(editor_prof.hist));
+    editor_prof.enabled = true;
+    editor_prof.key_time = 0;
+    editor_prof.highlight_ns = 0;
+}
+
+void bench_report(const char *bench, const char *corpus, size_t bytes, size_t ops,
+                  uint64_t ns, prof_histogram_t *lat) {
+    double secs = ns / 1e9;
+    fprintf(bench_out,
+            "{\"bench\":\"%s\",\"corpus\":\"%s\",\"bytes\":%zu,\"ops\":%zu,"
+            "\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+            "\"p50_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,"
+            "\"frame_bytes_p50\":%llu,\"frame_bytes_max\":%llu}\n",
+            bench, corpus, bytes, ops, secs, secs > 0 ? ops / secs : 0.0,
+            secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0,
+            (unsigned long long)prof_percentile(lat, 50.0),
+            (unsigned long long)prof_percentile(lat, 99.0), (unsigned long long)lat->max,
+            (unsigned long long)prof_percentile(&editor_prof.hist[PROF_FRAME_BYTES], 50.0),
+            (unsigned long long)editor_prof.hist[PROF_FRAME_BYTES].max);
+    fflush(bench_out);
+}
+
+void bench_report_keys(const char *bench, const char *corpus, size_t bytes, size_t ops,
+                       uint64_t ns) {
+    bench_report(bench, corpus, bytes, ops, ns, &editor_prof.hist[PROF_LATENCY]);
+}
+
+void bench_report_single(const char *bench, const char *corpus, size_t bytes, uint64_t ns) {
+    prof_histogram_t lat = {0};
+    prof_hist_record(&lat, ns);
+    bench_report(bench, corpus, bytes, 1, ns, &lat);
+}
+
+size_t bench_render_bytes() {
+    size_t bytes = 0;
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) { bytes += editor_cfg.buf->erows[j].rsize; }
+    return bytes;
+}
+
+void bench_place_cursor(size_t cy, size_t cx) {
+    editor_cfg.buf->cy = cy < editor_cfg.buf->num_erows ? cy : editor_cfg.buf->num_erows;
+    size_t size = editor_cfg.buf->cy < editor_cfg.buf->num_erows ? editor_cfg.buf->erows[editor_cfg.buf->cy].size : 0;
+    editor_cfg.buf->cx = cx < size ? cx : size;
+    editor_undo_boundary();
+    editor_refresh_screen();
+}
+
+char *bench_repeat(const char *unit, size_t count, size_t *len) {
+    size_t unit_len = strlen(unit);
+    *len = unit_len * count;
+    char *buf = malloc(*len);
+    if (buf == NULL) { bench_die("bench_repeat :: malloc"); }
+    for (size_t i = 0; i < count; i++) { memcpy(&buf[i * unit_len], unit, unit_len); }
+    return buf;
+}
+
+char *bench_read_file(const char *path, size_t *len) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) { bench_die("bench_read_file :: fopen"); }
+    size_t cap = 4096;
+    char *buf = malloc(cap);
+    *len = 0;
+    size_t nread = 0;
+    while (buf != NULL && (nread = fread(&buf[*len], 1, cap - *len, fp)) > 0) {
+        *len += nread;
+        if (*len == cap) { buf = realloc(buf, cap *= 2); }
+    }
+
+    if (buf == NULL) { bench_die("bench_read_file :: malloc"); }
+    fclose(fp);
+    return buf;
+}
+
+/* Replays each recorded keystroke script (raw terminal input, as captured from a
+ * session) from the top of a fresh copy of the corpus, up to its first <C-q>. The
+ * buffer is renamed to a temporary file first, so a <C-s> in the script never writes
+ * over the corpus. */
+void bench_replay_scripts(const char *path, const char *name) {
+    for (size_t i = 0; i < bench_num_scripts; i++) {
+        size_t len = 0;
+        char *keys = bench_read_file(bench_scripts[i], &len);
+        char *quit = memchr(keys, CTRL_KEY('q'), len);
+        if (quit != NULL) { len = quit - keys; }
+        char save_path[] = "/tmp/kbench-script-XXXXXX";
+        int fd = mkstemp(save_path);
+        if (fd == -1) { bench_die("bench_replay_scripts :: mkstemp"); }
+        close(fd);
+
+        bench_reset();
+        editor_open((char *)path);
+        free(editor_cfg.buf->filename);
+        editor_cfg.buf->filename = strdup(save_path);
+        bench_place_cursor(0, 0);
+        bench_begin();
+        uint64_t start = prof_now();
+        bench_feed(keys, len, false);
+        uint64_t ns = prof_now() - start;
+
+        const char *base = strrchr(bench_scripts[i], '/');
+        char bench[PATH_MAX];
+        snprintf(bench, sizeof(bench), "script:%s", base != NULL ? base + 1 : bench_scripts[i]);
+        bench_report_keys(bench, name, len, editor_prof.hist[PROF_LATENCY].total, ns);
+        unlink(save_path);
+        free(keys);
+    }
+
+    editor_prof.enabled = false;
+}
+
+/* Replaces the query with one letter, first under an undo cap that holds the new text
+ * of the replace but not the old, then under one that holds both. Undo must drop the
+ * whole replace in the first case and restore it exactly in the second. */
+void bench_replace_capped(const char *path, const char *name) {
+    size_t query_len = strlen(bench_query);
+    size_t len = 1 + query_len + 1 + 1 + 1;
+    char *keys = malloc(len + 1);
+    if (keys == NULL) { bench_die("bench_replace_capped :: malloc"); }
+    snprintf(keys, len + 1, "%c%s\r%c\r", CTRL_KEY('r'), bench_query, bench_query[0]);
+
+    editor_replace_job_t job = {.query = bench_query, .query_len = query_len};
+    for (int capped = 1; capped >= 0; capped--) {
+        bench_reset();
+        editor_open((char *)path);
+        size_t first = SIZE_MAX;
+        size_t last = 0;
+        size_t count = 0;
+        for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) {
+            editor_row_t *erow = &editor_cfg.buf->erows[j];
+            size_t row_count = editor_replace_row(erow, &job, NULL);
+            if (row_count == 0) { continue; }
+            if (first == SIZE_MAX) { first = j; }
+            last = j;
+            count += row_count;
+        }
+
+        if (count == 0 || query_len < 2) { break; }
+        size_t old_span = 0;
+        for (size_t j = first; j <= last; j++) { old_span += editor_cfg.buf->erows[j].size + 1; }
+        size_t new_span = old_span - count * (query_len - 1);
+        editor_cfg.buf->undo.limit = capped ? new_span + (old_span - new_span) / 2 : (old_span + new_span) * 2;
+
+        size_t before_len = 0;
+        char *before = editor_rows_to_string(&before_len);
+        bench_begin();
+        uint64_t start = prof_now();
+        bench_feed(keys, len, false);
+        size_t after_len = 0;
+        char *after = editor_rows_to_string(&after_len);
+        bench_feed("\x1a", 1, false);
+        uint64_t ns = prof_now() - start;
+        size_t undone_len = 0;
+        char *undone = editor_rows_to_string(&undone_len);
+        const char *expect = capped ? after : before;
+        size_t expect_len = capped ? after_len : before_len;
+        if (undone_len != expect_len || memcmp(undone, expect, expect_len) != 0) {
+            bench_die("bench_replace_capped :: undo");
+        }
+
+        bench_report_single(capped ? "replace_over_cap" : "replace_under_cap", name, before_len, ns);
+        free(before);
+        free(after);
+        free(undone);
+    }
+
+    free(keys);
+    editor_prof.enabled = false;
+}
+
+void bench_corpus(const char *path, const char *name) {
+    struct stat st;
+    if (stat(path, &st) == -1) { bench_die("bench_corpus :: stat"); }
+    bench_reset();
+    memset(editor_prof.hist, 0, sizeof(editor_prof.hist));
+
+    uint64_t start = prof_now();
+    editor_open((char *)path);
+    bench_report_single("load", name, st.st_size, prof_now() - start);
+
+    bench_reset();
+    start = prof_now();
+    editor_open((char *)path);
+    bench_report_single("reopen", name, st.st_size, prof_now() - start);
+
+    start = prof_now();
+    editor_select_syntax();
+    bench_report_single("highlight", name, bench_render_bytes(), prof_now() - start);
+
+    size_t len = 0;
+    char *keys = bench_repeat("\x1b[6~", BENCH_SCROLL_PAGES, &len);
+    bench_place_cursor(0, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_keys("scroll", name, len, BENCH_SCROLL_PAGES, prof_now() - start);
+    free(keys);
+
+    keys = bench_repeat("int x = 42; ", BENCH_TYPING_KEYS / 12, &len);
+    bench_place_cursor(editor_cfg.buf->num_erows / 2, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_keys("typing", name, len, len, prof_now() - start);
+    free(keys);
+
+    keys = bench_repeat("    total += compute(value, \"pasted\"); /* paste */\r",
+                        BENCH_PASTE_BYTES / 52, &len);
+    bench_place_cursor(editor_cfg.buf->num_erows / 3, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_keys("paste", name, len, len, prof_now() - start);
+
+    bench_place_cursor(editor_cfg.buf->num_erows / 3, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, true);
+    bench_report_keys("paste_paced", name, len, len, prof_now() - start);
+    free(keys);
+
+    bench_begin();
+    start = prof_now();
+    bench_feed("\x1a\x19", 2, false);
+    bench_report_keys("undo_redo", name, len, 2, prof_now() - start);
+
+    editor_buffer_new();
+    editor_buffer_switch(0);
+    keys = bench_repeat("\x0e", BENCH_SWITCHES, &len);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_keys("switch", name, len, len, prof_now() - start);
+    free(keys);
+    editor_buffer_switch(1);
+    editor_buffer_close();
+    editor_buffer_switch(0);
+
+    keys = bench_repeat("\r", BENCH_NEWLINES, &len);
+    bench_place_cursor(editor_cfg.buf->num_erows / 2, 4);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_keys("newline", name, len, len, prof_now() - start);
+    free(keys);
+
+    size_t query_len = strlen(bench_query);
+    len = 1 + query_len + BENCH_SEARCH_STEPS * 3 + 1;
+    keys = malloc(len);
+    if (keys == NULL) { bench_die("bench_corpus :: malloc"); }
+    keys[0] = CTRL_KEY('f');
+    memcpy(&keys[1], bench_query, query_len);
+    for (size_t i = 0; i < BENCH_SEARCH_STEPS; i++) { memcpy(&keys[1 + query_len + i * 3], "\x1b[B", 3); }
+    keys[len - 1] = '\r';
+    bench_place_cursor(0, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_keys("search", name, len, query_len + BENCH_SEARCH_STEPS, prof_now() - start);
+    free(keys);
+
+    len = 1 + query_len + 1 + query_len + 3;
+    keys = malloc(len + 1);
+    if (keys == NULL) { bench_die("bench_corpus :: malloc"); }
+    snprintf(keys, len + 1, "%c%s\r%s_2\r", CTRL_KEY('r'), bench_query, bench_query);
+    size_t bytes = 0;
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) { bytes += editor_cfg.buf->erows[j].size + 1; }
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    bench_report_single("replace", name, bytes, prof_now() - start);
+    free(keys);
+
+    char save_path[] = "/tmp/kbench-save-XXXXXX";
+    int fd = mkstemp(save_path);
+    if (fd == -1) { bench_die("bench_corpus :: mkstemp"); }
+    close(fd);
+    free(editor_cfg.buf->filename);
+    editor_cfg.buf->filename = strdup(save_path);
+    bench_begin();
+    start = prof_now();
+    editor_save();
+    uint64_t ns = prof_now() - start;
+    if (stat(save_path, &st) == -1) { bench_die("bench_corpus :: stat"); }
+    bench_report_single("save", name, st.st_size, ns);
+    unlink(save_path);
+
+    editor_prof.enabled = false;
+    bench_replace_capped(path, name);
+    bench_replay_scripts(path, name);
+}
+
+void bench_synthetic(char *path, size_t mb) {
+    int fd = mkstemps(path, 2);
+    if (fd == -1) { bench_die("bench_synthetic :: mkstemps"); }
+    FILE *fp = fdopen(fd, "w");
+    size_t target = mb * 1024 * 1024;
+    for (unsigned i = 0; (size_t)ftell(fp) < target; i++) {
+        fprintf(fp,
+                "/* block %u: synthetic corpus\n * spanning comment */\n"
+                "static int func_%u(int a, char *b) {\n"
+                "    // scan for the needle %u\n"
+                "\tif (b != NULL && a > %u) { return strlen(\"string literal\") + 3.14; }\n"
+                "    return a * %u;\n}\n\n",
+                i, i, i, i % 97, i % 13);
+    }
+
+    fclose(fp);
+}
+
+/* Checks a single line of the given size with the needle at its very end: it loads
+ * as one row, the needle is found at its full column offset and saving writes back as
+ * many bytes as were read. Past 4 GiB this covers the per-row sizes and offsets. */
+void bench_large_line(size_t mb) {
+    char path[] = "/tmp/kbench-line-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) { bench_die("bench_large_line :: mkstemp"); }
+    size_t needle_len = strlen(BENCH_LARGE_NEEDLE);
+    size_t chunk_len = 0;
+    char *chunk = bench_repeat("line_of_text_without_breaks_", 1024 * 1024 / 28, &chunk_len);
+    size_t line = mb * 1024 * 1024;
+    size_t written = 0;
+    while (written + needle_len < line) {
+        size_t len = line - needle_len - written < chunk_len ? line - needle_len - written : chunk_len;
+        if (!editor_write_all(fd, chunk, len)) { bench_die("bench_large_line :: write"); }
+        written += len;
+    }
+
+    if (!editor_write_all(fd, BENCH_LARGE_NEEDLE "\n", needle_len + 1)) { bench_die("bench_large_line :: write"); }
+    close(fd);
+    free(chunk);
+
+    struct stat st;
+    if (stat(path, &st) == -1) { bench_die("bench_large_line :: stat"); }
+    bench_reset();
+    memset(editor_prof.hist, 0, sizeof(editor_prof.hist));
+    uint64_t start = prof_now();
+    editor_open(path);
+    uint64_t ns = prof_now() - start;
+    if (editor_cfg.buf->num_erows != 1 || editor_cfg.buf->erows[0].size + 1 != (size_t)st.st_size) {
+        bench_die("bench_large_line :: load size mismatch");
+    }
+    bench_report_single("large_line_load", path, st.st_size, ns);
+
+    size_t len = 1 + needle_len + 1;
+    char keys[64];
+    snprintf(keys, sizeof(keys), "%c%s\r", CTRL_KEY('f'), BENCH_LARGE_NEEDLE);
+    bench_place_cursor(0, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    if (editor_cfg.buf->cy != 0 || editor_cfg.buf->cx != editor_cfg.buf->erows[0].size - needle_len) {
+        bench_die("bench_large_line :: search");
+    }
+    bench_report_keys("large_line_search", path, st.st_size, len, prof_now() - start);
+
+    start = prof_now();
+    editor_save();
+    ns = prof_now() - start;
+    struct stat saved;
+    if (stat(path, &saved) == -1 || saved.st_size != st.st_size) { bench_die("bench_large_line :: save size mismatch"); }
+    bench_report_single("large_line_save", path, saved.st_size, ns);
+
+    editor_prof.enabled = false;
+    bench_reset();
+    unlink(path);
+}
+
+/* Checks a corpus too large for 32-bit sizes: every byte loads, the last line can be
+ * reached and found, and saving writes back as many bytes as were read. A single line
+ * of the same size is checked after it. */
+void bench_large(size_t mb) {
+    char path[] = "/tmp/kbench-large-XXXXXX.c";
+    bench_synthetic(path, mb);
+    FILE *fp = fopen(path, "a");
+    if (fp == NULL) { bench_die("bench_large :: fopen"); }
+    fprintf(fp, "%s\n", BENCH_LARGE_NEEDLE);
+    fclose(fp);
+
+    struct stat st;
+    if (stat(path, &st) == -1) { bench_die("bench_large :: stat"); }
+    bench_reset();
+    memset(editor_prof.hist, 0, sizeof(editor_prof.hist));
+    uint64_t start = prof_now();
+    editor_open(path);
+    uint64_t ns = prof_now() - start;
+    size_t bytes = 0;
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) { bytes += editor_cfg.buf->erows[j].size + 1; }
+    if (bytes != (size_t)st.st_size) { bench_die("bench_large :: load size mismatch"); }
+    bench_report_single("large_load", path, st.st_size, ns);
+
+    size_t last = editor_cfg.buf->num_erows - 1;
+    bench_place_cursor(0, 0);
+    bench_begin();
+    start = prof_now();
+    editor_goto_line(editor_cfg.buf->num_erows);
+    bench_feed("\x1b[5~\x1b[6~", 8, false);
+    if (editor_cfg.buf->cy != editor_cfg.buf->num_erows) { bench_die("bench_large :: navigation"); }
+    bench_report_keys("large_navigate", path, st.st_size, 2, prof_now() - start);
+
+    size_t len = 1 + strlen(BENCH_LARGE_NEEDLE) + 1;
+    char keys[64];
+    snprintf(keys, sizeof(keys), "%c%s\r", CTRL_KEY('f'), BENCH_LARGE_NEEDLE);
+    bench_place_cursor(0, 0);
+    bench_begin();
+    start = prof_now();
+    bench_feed(keys, len, false);
+    if (editor_cfg.buf->cy != last) { bench_die("bench_large :: search"); }
+    bench_report_keys("large_search", path, st.st_size, len, prof_now() - start);
+
+    free(editor_cfg.buf->filename);
+    editor_cfg.buf->filename = strdup(path);
+    start = prof_now();
+    editor_save();
+    ns = prof_now() - start;
+    struct stat saved;
+    if (stat(path, &saved) == -1 || saved.st_size != st.st_size) { bench_die("bench_large :: save size mismatch"); }
+    bench_report_single("large_save", path, saved.st_size, ns);
+
+    editor_prof.enabled = false;
+    bench_reset();
+    unlink(path);
+    bench_large_line(mb);
+}
+
+void bench_remove_cache(const char *cache) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/kilo", cache);
+    DIR *dp = opendir(dir);
+    struct dirent *entry = NULL;
+    while (dp != NULL && (entry = readdir(dp)) != NULL) {
+        if (entry->d_name[0] == '.') { continue; }
+        char path[PATH_MAX + 256];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        unlink(path);
+    }
+
+    if (dp != NULL) { closedir(dp); }
+    rmdir(dir);
+    rmdir(cache);
+}
+
+int main(int argc, char *argv[]) {
+    size_t synthetic_mb = BENCH_SYNTHETIC_MB;
+    size_t large_mb = 0;
+    int opt = 0;
+    while ((opt = getopt(argc, argv, "s:q:L:k:")) != -1) {
+        switch (opt) {
+            case 's': synthetic_mb = strtoul(optarg, NULL, 10); break;
+            case 'q': bench_query = optarg; break;
+            case 'L': large_mb = strtod(optarg, NULL) * 1024; break;
+            case 'k':
+                if (bench_num_scripts < BENCH_MAX_SCRIPTS) {
+                    bench_scripts[bench_num_scripts++] = optarg;
+                    break;
+                }
+                /* fall through */
+            default:
+                fprintf(stderr, "usage: %s [-s synthetic_mb] [-q query] [-L large_gb] [-k script]... [corpus...]\n",
+                        argv[0]);
+                return 1;
+        }
+    }
+
+    char cache[] = "/tmp/kbench-cache-XXXXXX";
+    if (mkdtemp(cache) == NULL) { bench_die("main :: mkdtemp"); }
+    setenv("XDG_CACHE_HOME", cache, 1);
+
+    bench_out = fdopen(dup(STDOUT_FILENO), "w");
+    int sink = open("/dev/null", O_WRONLY);
+    if (bench_out == NULL || sink == -1) { bench_die("main :: open"); }
+    dup2(sink, STDOUT_FILENO);
+    close(sink);
+
+    int input[2];
+    if (pipe(input) == -1) { bench_die("main :: pipe"); }
+    fcntl(input[0], F_SETFL, O_NONBLOCK);
+    dup2(input[0], STDIN_FILENO);
+    close(input[0]);
+    bench_input_fd = input[1];
+
+    if (synthetic_mb > 0) {
+        char path[] = "/tmp/kbench-XXXXXX.c";
+        bench_synthetic(path, synthetic_mb);
+        bench_corpus(path, "synthetic");
+        unlink(path);
+    }
+
+    for (int i = optind; i < argc; i++) { bench_corpus(argv[i], argv[i]); }
+    if (large_mb > 0) { bench_large(large_mb); }
+    bench_reset();
+    bench_remove_cache(cache);
+    return 0;
+}
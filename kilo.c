@@ -2,16 +2,24 @@
 #define _BSD_SOURCE
 #define _GNU_SOURCE
 
+#include <sys/inotify.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,8 +28,26 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
-
-#define CTRL_KEY(key) (key) & 0x1f
+#define KILO_PROF_DEFAULT_PATH "kilo.prof"
+#define KILO_PROF_SUB_BITS 4
+#define KILO_PROF_BUCKETS ((64 - KILO_PROF_SUB_BITS + 1) << KILO_PROF_SUB_BITS)
+#define KILO_ALLOC_DEFAULT_PATH "kilo.alloc"
+#define KILO_FRAME_MIN_NS 8000000ull
+#define KILO_FRAME_MAX_NS 100000000ull
+#define KILO_FOLLOW_CHUNK 65536
+#define KILO_FOLLOW_RETRY_MS 1000
+#define KILO_JOURNAL_MAGIC "KILOJNL1"
+#define KILO_JOURNAL_FLUSH_NS 1000000000ull
+#define KILO_UNDO_LIMIT (64u << 20)
+#define KILO_INDEX_MAGIC "KILOIDX1"
+#define KILO_INDEX_MIN_SIZE (1u << 20)
+#define KILO_INDEX_CHECK 4096
+#define KILO_REPLACE_THREADS 8
+#define KILO_REPLACE_PARALLEL (1u << 20)
+#define KILO_SYNTAX_MAGIC "KILOSYN1"
+#define KILO_SYNTAX_NAME_MAX 15
+
+#define CTRL_KEY(key) ((key) & 0x1f)
 
 enum editor_key {
     BACKSPACE = 127,
@@ -50,82 +76,626 @@ enum editor_highlight {
 #define HL_HIGHLIGHT_NUMBERS (1 << 0)
 #define HL_HIGHLIGHT_STRINGS (1 << 1)
 
+/* Compiled syntax bundle, built by kilo --build-syntax from .syn files and mapped at
+ * startup. The header is followed by the language table, an open-addressed hash of
+ * file extensions and names to languages, one keyword hash per language and a blob of
+ * NUL-terminated strings. Offsets are from the start of the bundle; string offset 0 is
+ * the empty string and marks an unused slot or a missing delimiter. */
 typedef struct {
-    char *filetype;
-    char **filematch;
-    char **keywords;
-    char *singleline_comment_start;
-    char *multiline_comment_start;
-    char *multiline_comment_end;
+    char magic[8];
+    uint64_t size;
+    uint32_t num_langs;
+    uint32_t langs;
+    uint32_t match_slots;
+    uint32_t matches;
+    uint32_t strings;
+    uint32_t strings_len;
+} syntax_bundle_header_t;
+
+typedef struct {
+    uint32_t name;
+    uint32_t singleline_comment_start;
+    uint32_t multiline_comment_start;
+    uint32_t multiline_comment_end;
+    uint32_t flags;
+    uint32_t keyword_slots;
+    uint32_t keywords;
+    uint32_t reserved;
+} syntax_bundle_lang_t;
+
+/* Hash slot: a language index for matches, 1 or 2 for the keyword class */
+typedef struct {
+    uint32_t hash;
+    uint32_t str;
+    uint32_t len;
+    uint32_t value;
+} syntax_slot_t;
+
+typedef struct {
+    const char *filetype;
+    const char *singleline_comment_start;
+    const char *multiline_comment_start;
+    const char *multiline_comment_end;
+    size_t scs_len;
+    size_t mcs_len;
+    size_t mce_len;
     unsigned flags;
+    const syntax_slot_t *keywords;
+    uint32_t keyword_slots;
 } editor_syntax;
 
 typedef struct {
-    unsigned idx;
-    unsigned size;
-    unsigned rsize;
+    size_t idx;
+    size_t size;
+    size_t rsize;
     char *chars;
     char *render;
     unsigned char *highlight;
     bool hl_open_comment;
+    bool ascii;
 } editor_row_t;
 
+/* Frame buffer for terminal output. Also tracks the SGR attributes the terminal will
+ * have once the buffer is written so attribute changes are only emitted when needed. */
 typedef struct {
-    unsigned cx;
-    unsigned cy;
-    unsigned rx;
-    unsigned row_offset;
-    unsigned col_offset;
-    unsigned screen_rows;
-    unsigned screen_cols;
-    unsigned num_erows;
+    char *data;
+    size_t len;
+    size_t cap;
+    int sgr_colour;
+    bool sgr_inverse;
+} abuf;
+
+#define ABUF_INIT {NULL, 0, 0, 39, false}
+
+static const char *SGR_FG[] = {
+    "\x1b[30m", "\x1b[31m", "\x1b[32m", "\x1b[33m", "\x1b[34m",
+    "\x1b[35m", "\x1b[36m", "\x1b[37m", "\x1b[38m", "\x1b[39m"
+};
+
+enum editor_edit_op {
+    EDIT_INSERT_CHAR = 1,
+    EDIT_DELETE_CHAR,
+    EDIT_INSERT_ROW,
+    EDIT_DELETE_ROW,
+    EDIT_APPEND_STRING,
+    EDIT_SPLIT_ROW,
+    EDIT_JOIN_ROW,
+    EDIT_INSERT_TEXT,
+    EDIT_DELETE_TEXT,
+};
+
+/* Identifies the on-disk file a journal applies to, followed by the writer's pid */
+typedef struct {
+    char magic[8];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    int64_t pid;
+} editor_journal_header_t;
+
+typedef struct {
+    int fd;
+    bool failed;
+    char *path;
+    abuf pending;
+    uint64_t flush_at;
+} editor_journal_t;
+
+enum editor_undo_type {
+    UNDO_INSERT = 0,
+    UNDO_DELETE,
+    UNDO_INSERT_ROW,
+    UNDO_DELETE_ROW,
+};
+
+/* Text inserted at or deleted from (row, col), with rows joined by newlines. The
+ * payload lives in the undo arena. Records of one group are undone together. */
+typedef struct {
+    unsigned char type;
+    size_t row;
+    size_t col;
+    size_t end_row;
+    size_t end_col;
+    size_t offset;
+    size_t len;
+    uint64_t group;
+} undo_record_t;
+
+typedef struct {
+    undo_record_t *records;
+    size_t count;
+    size_t total;
+    size_t cap;
+    char *arena;
+    size_t arena_start;
+    size_t arena_len;
+    size_t arena_cap;
+    size_t limit;
+    uint64_t group;
+    bool group_open;
+    bool applying;
+} editor_undo_t;
+
+/* On-disk line index: the header is followed by the start offset of every line and
+ * a bitset of the lines that end inside a multi-line comment of the named syntax */
+typedef struct {
+    char magic[8];
+    uint64_t dev;
+    uint64_t inode;
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t lines;
+    uint64_t checksum;
+    char syntax[16];
+} editor_index_header_t;
+
+typedef struct {
+    uint64_t *offsets;
+    unsigned char *states;
+    uint64_t lines;
+    uint64_t cap;
+    void *map;
+    size_t map_len;
+} editor_index_t;
+
+typedef struct {
+    bool enabled;
+    int fd;
+    int watch;
+    off_t offset;
+    bool partial;
+    ino_t inode;
+} editor_follow_t;
+
+/* One open document. Everything that belongs to a file lives here, so switching
+ * buffers is a pointer swap that keeps cursor, render and highlight state intact. */
+typedef struct {
+    size_t cx;
+    size_t cy;
+    size_t rx;
+    size_t row_offset;
+    size_t col_offset;
+    size_t num_erows;
+    size_t erows_cap;
     editor_row_t *erows;
     bool dirty;
     char *filename;
+    editor_syntax *syntax;
+    editor_follow_t follow;
+    editor_journal_t journal;
+    editor_undo_t undo;
+    size_t pool_bytes;
+} editor_buffer_t;
+
+typedef struct {
+    editor_buffer_t *buf;
+    editor_buffer_t **buffers;
+    unsigned num_buffers;
+    unsigned buffers_cap;
+    unsigned screen_rows;
+    unsigned screen_cols;
     char status_msg[80];
     time_t status_msg_time;
-    editor_syntax *syntax;
+    bool sync_output;
+    unsigned edit_nesting;
     struct termios orig_termios;
 } editor_config_t;
 
 static editor_config_t editor_cfg;
 
-static char *C_HL_ext[] = {".c", ".h", ".cpp", NULL};
-
-static char *C_HL_keywords[] = {
-    "switch", "if", "while", "for", "break", "continue", "return", "else", "struct",
-    "union", "typedef", "static", "enum", "class", "case", "int|", "long|",  "double|",
-    "float|", "char|", "unsigned|", "signed|", "void|", NULL
-};
+/* Used when no syntax bundle is installed, compiled the same way as syntax/c.syn */
+static const char C_HL_SYN[] =
+    "name c\n"
+    "extensions .c .h .cpp\n"
+    "keywords switch if while for break continue return else struct union typedef static enum class case\n"
+    "types int long double float char unsigned signed void\n"
+    "comment //\n"
+    "comment_start /*\n"
+    "comment_end */\n"
+    "flags numbers strings\n";
 
-static editor_syntax HLDB[] = {{
-        "c", C_HL_ext, C_HL_keywords, "//", "/*", "*/",
-        HL_HIGHLIGHT_NUMBERS | HL_HIGHLIGHT_STRINGS
-}};
+typedef struct {
+    const char *data;
+    size_t len;
+    bool mapped;
+    const syntax_bundle_header_t *hdr;
+    const char *strings;
+    editor_syntax *langs;
+} editor_syntax_db_t;
+
+static editor_syntax_db_t editor_syntax_db;
+
+void abuf_append(abuf *ab, const char *str, size_t len) {
+    if (ab->len + len > ab->cap) {
+        size_t cap = ab->cap != 0 ? ab->cap * 2 : 4096;
+        while (cap < ab->len + len) { cap *= 2; }
+        char *new = realloc(ab->data, cap);
+        if (new == NULL) { return; }
+        ab->data = new;
+        ab->cap = cap;
+    }
 
-static const size_t HLDB_ENTRIES = sizeof(HLDB) / sizeof(editor_syntax);
+    memcpy(&ab->data[ab->len], str, len);
+    ab->len += len;
+}
 
-typedef struct {
-    char *data;
-    unsigned len;
-} abuf;
+void abuf_sgr(abuf *ab, int colour, bool inverse) {
+    if (colour == 39 && !inverse && ab->sgr_colour != 39 && ab->sgr_inverse) {
+        abuf_append(ab, "\x1b[m", 3);
+    } else {
+        if (inverse != ab->sgr_inverse) {
+            abuf_append(ab, inverse ? "\x1b[7m" : "\x1b[27m", inverse ? 4 : 5);
+        }
 
-#define ABUF_INIT {NULL, 0}
+        if (colour != ab->sgr_colour) { abuf_append(ab, SGR_FG[colour - 30], 5); }
+    }
 
-void abuf_append(abuf *ab, const char *str, unsigned len) {
-    char *new = realloc(ab->data, ab->len + len);
-    if (new == NULL) { return; }
-    memcpy(&new[ab->len], str, len);
-    ab->data = new;
-    ab->len += len;
+    ab->sgr_colour = colour;
+    ab->sgr_inverse = inverse;
 }
 
 void abuf_free(abuf *ab) {
     free(ab->data);
     ab->data = NULL;
     ab->len = 0;
+    ab->cap = 0;
+}
+
+enum editor_prof_stage {
+    PROF_KEYPRESS = 0,
+    PROF_HIGHLIGHT,
+    PROF_DRAW_ROWS,
+    PROF_WRITE,
+    PROF_LATENCY,
+    PROF_FRAME_BYTES,
+    PROF_STAGES
+};
+
+static const char *PROF_STAGE_NAMES[PROF_STAGES] = {
+    "keypress", "highlight", "draw_rows", "write", "latency", "frame_bytes"
+};
+
+/* Log-linear (HDR style) histogram: 16 linear sub-buckets per power of two */
+typedef struct {
+    uint64_t counts[KILO_PROF_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+} prof_histogram_t;
+
+typedef struct {
+    bool enabled;
+    bool atexit_registered;
+    const char *dump_path;
+    uint64_t key_time;
+    uint64_t last_key_time;
+    uint64_t highlight_ns;
+    uint64_t frames;
+    prof_histogram_t hist[PROF_STAGES];
+} editor_prof_t;
+
+static editor_prof_t editor_prof;
+
+uint64_t prof_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+unsigned prof_bucket(uint64_t value) {
+    if (value < (1u << KILO_PROF_SUB_BITS)) { return value; }
+    unsigned shift = 63 - __builtin_clzll(value) - KILO_PROF_SUB_BITS;
+    unsigned sub = (value >> shift) & ((1u << KILO_PROF_SUB_BITS) - 1);
+    return ((shift + 1) << KILO_PROF_SUB_BITS) + sub;
+}
+
+uint64_t prof_bucket_lower(unsigned idx) {
+    if (idx < (1u << KILO_PROF_SUB_BITS)) { return idx; }
+    unsigned shift = (idx >> KILO_PROF_SUB_BITS) - 1;
+    uint64_t sub = idx & ((1u << KILO_PROF_SUB_BITS) - 1);
+    return ((1ull << KILO_PROF_SUB_BITS) + sub) << shift;
+}
+
+void prof_hist_record(prof_histogram_t *hist, uint64_t value) {
+    hist->counts[prof_bucket(value)] += 1;
+    if (hist->total == 0 || value < hist->min) { hist->min = value; }
+    if (value > hist->max) { hist->max = value; }
+    hist->total += 1;
+    hist->sum += value;
+}
+
+void prof_record(enum editor_prof_stage stage, uint64_t value) {
+    prof_hist_record(&editor_prof.hist[stage], value);
+}
+
+uint64_t prof_percentile(prof_histogram_t *hist, double pct) {
+    if (hist->total == 0) { return 0; }
+    uint64_t target = (uint64_t)(hist->total * pct / 100.0);
+    if (target == 0) { target = 1; }
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < KILO_PROF_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= target) {
+            uint64_t upper = prof_bucket_lower(i + 1) - 1;
+            return upper < hist->max ? upper : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+unsigned prof_format_ns(char *buf, size_t size, uint64_t ns) {
+    if (ns < 1000) { return snprintf(buf, size, "%uns", (unsigned)ns); }
+    if (ns < 1000000) { return snprintf(buf, size, "%.1fus", ns / 1e3); }
+    return snprintf(buf, size, "%.1fms", ns / 1e6);
+}
+
+void editor_prof_dump() {
+    FILE *fp = fopen(editor_prof.dump_path, "w");
+    if (fp == NULL) { return; }
+    fprintf(fp, "# kilo %s profile: %llu frames, times in ns\n", KILO_VERSION,
+            (unsigned long long)editor_prof.frames);
+    fprintf(fp, "# stage count min p50 p90 p99 p999 max mean\n");
+    for (unsigned s = 0; s < PROF_STAGES; s++) {
+        prof_histogram_t *hist = &editor_prof.hist[s];
+        fprintf(fp, "stage %s %llu %llu %llu %llu %llu %llu %llu %.1f\n", PROF_STAGE_NAMES[s],
+                (unsigned long long)hist->total, (unsigned long long)hist->min,
+                (unsigned long long)prof_percentile(hist, 50.0),
+                (unsigned long long)prof_percentile(hist, 90.0),
+                (unsigned long long)prof_percentile(hist, 99.0),
+                (unsigned long long)prof_percentile(hist, 99.9),
+                (unsigned long long)hist->max,
+                hist->total != 0 ? (double)hist->sum / hist->total : 0.0);
+    }
+
+    fprintf(fp, "# stage bucket_lower count\n");
+    for (unsigned s = 0; s < PROF_STAGES; s++) {
+        for (unsigned i = 0; i < KILO_PROF_BUCKETS; i++) {
+            if (editor_prof.hist[s].counts[i] == 0) { continue; }
+            fprintf(fp, "bucket %s %llu %llu\n", PROF_STAGE_NAMES[s],
+                    (unsigned long long)prof_bucket_lower(i),
+                    (unsigned long long)editor_prof.hist[s].counts[i]);
+        }
+    }
+
+    fclose(fp);
+}
+
+void editor_prof_enable(bool enabled) {
+    editor_prof.enabled = enabled;
+    editor_prof.key_time = 0;
+    editor_prof.last_key_time = prof_now();
+    editor_prof.highlight_ns = 0;
+    if (enabled && !editor_prof.atexit_registered) {
+        if (editor_prof.dump_path == NULL) { editor_prof.dump_path = KILO_PROF_DEFAULT_PATH; }
+        atexit(editor_prof_dump);
+        editor_prof.atexit_registered = true;
+    }
+}
+
+void editor_prof_init() {
+    char *path = getenv("KILO_PROFILE");
+    if (path == NULL) { return; }
+    editor_prof.dump_path = path[0] != '\0' ? path : KILO_PROF_DEFAULT_PATH;
+    editor_prof_enable(true);
+}
+
+void editor_prof_key() {
+    if (!editor_prof.enabled) { return; }
+    editor_prof.last_key_time = prof_now();
+    if (editor_prof.key_time == 0) { editor_prof.key_time = editor_prof.last_key_time; }
+}
+
+#ifdef KILO_ALLOC_TRACK
+#include <malloc.h>
+#include <sys/resource.h>
+
+enum editor_alloc_op {
+    ALLOC_OP_OTHER = 0,
+    ALLOC_OP_OPEN,
+    ALLOC_OP_INSERT,
+    ALLOC_OP_NEWLINE,
+    ALLOC_OP_DELETE,
+    ALLOC_OP_MOVE,
+    ALLOC_OP_FIND,
+    ALLOC_OP_SAVE,
+    ALLOC_OP_RENDER,
+    ALLOC_OPS
+};
+
+/* The tracking build (make akilo) replaces malloc and friends for the whole process,
+ * libc internals included, and forwards to glibc's own allocator. */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+static const char *ALLOC_OP_NAMES[ALLOC_OPS] = {
+    "other", "open", "insert", "newline", "delete", "move", "find", "save", "render"
+};
+
+typedef struct {
+    uint64_t ops;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t bytes;
+    int64_t peak_live;
+} alloc_stats_t;
+
+typedef struct {
+    bool live_view;
+    enum editor_alloc_op op;
+    int64_t live;
+    int64_t peak_live;
+    alloc_stats_t stats[ALLOC_OPS];
+} editor_alloc_t;
+
+static editor_alloc_t editor_alloc;
+
+/* Counts an allocation of size bytes that occupies usable bytes; the buffer pool
+ * reports its blocks here too, since they never pass through malloc */
+void alloc_track_size(size_t size, size_t usable) {
+    alloc_stats_t *stats = &editor_alloc.stats[editor_alloc.op];
+    stats->allocs += 1;
+    stats->bytes += size;
+    editor_alloc.live += usable;
+    if (editor_alloc.live > editor_alloc.peak_live) { editor_alloc.peak_live = editor_alloc.live; }
+    if (editor_alloc.live > stats->peak_live) { stats->peak_live = editor_alloc.live; }
+}
+
+void alloc_untrack_size(size_t usable) {
+    editor_alloc.stats[editor_alloc.op].frees += 1;
+    editor_alloc.live -= usable;
+}
+
+void alloc_track(void *ptr, size_t size) {
+    if (ptr == NULL) { return; }
+    alloc_track_size(size, malloc_usable_size(ptr));
+}
+
+void alloc_untrack(void *ptr) {
+    if (ptr == NULL) { return; }
+    alloc_untrack_size(malloc_usable_size(ptr));
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    alloc_track(ptr, size);
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = __libc_calloc(nmemb, size);
+    alloc_track(ptr, nmemb * size);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    size_t old = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    void *new = __libc_realloc(ptr, size);
+    if (new == NULL && size != 0) { return NULL; }
+    editor_alloc.live -= old;
+    alloc_track(new, size);
+    return new;
+}
+
+void free(void *ptr) {
+    alloc_untrack(ptr);
+    __libc_free(ptr);
+}
+
+/* The aligned allocators are replaced too, since their blocks come back through free */
+void *memalign(size_t alignment, size_t size) {
+    void *ptr = __libc_memalign(alignment, size);
+    alloc_track(ptr, size);
+    return ptr;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0) { return EINVAL; }
+    void *ptr = memalign(alignment, size);
+    if (ptr == NULL) { return ENOMEM; }
+    *memptr = ptr;
+    return 0;
+}
+
+void *valloc(size_t size) {
+    void *ptr = __libc_valloc(size);
+    alloc_track(ptr, size);
+    return ptr;
+}
+
+void *pvalloc(size_t size) {
+    void *ptr = __libc_pvalloc(size);
+    alloc_track(ptr, size);
+    return ptr;
+}
+
+enum editor_alloc_op editor_alloc_enter(enum editor_alloc_op op) {
+    enum editor_alloc_op prev = editor_alloc.op;
+    editor_alloc.op = op;
+    editor_alloc.stats[op].ops += 1;
+    return prev;
+}
+
+void editor_alloc_leave(enum editor_alloc_op prev) {
+    editor_alloc.op = prev;
+}
+
+enum editor_alloc_op editor_alloc_key_op(unsigned key) {
+    switch (key) {
+        case '\r': return ALLOC_OP_NEWLINE;
+        case CTRL_KEY('f'):
+        case CTRL_KEY('r'): return ALLOC_OP_FIND;
+        case CTRL_KEY('s'): return ALLOC_OP_SAVE;
+        case DEL_KEY:
+        case BACKSPACE:
+        case CTRL_KEY('h'): return ALLOC_OP_DELETE;
+        case ARROW_UP:
+        case ARROW_LEFT:
+        case ARROW_DOWN:
+        case ARROW_RIGHT:
+        case HOME_KEY:
+        case END_KEY:
+        case PAGE_UP:
+        case PAGE_DOWN: return ALLOC_OP_MOVE;
+        default: return iscntrl(key) || key == '\x1b' ? ALLOC_OP_OTHER : ALLOC_OP_INSERT;
+    }
+}
+
+unsigned editor_alloc_format(char *buf, size_t size, enum editor_alloc_op op) {
+    alloc_stats_t *stats = &editor_alloc.stats[op];
+    uint64_t ops = stats->ops != 0 ? stats->ops : 1;
+    return snprintf(buf, size, "%s: %.1f allocs/op %.0f B/op | live %lldK peak %lldK",
+                    ALLOC_OP_NAMES[op], (double)stats->allocs / ops, (double)stats->bytes / ops,
+                    (long long)editor_alloc.live / 1024, (long long)editor_alloc.peak_live / 1024);
+}
+
+void editor_alloc_dump() {
+    char *path = getenv("KILO_ALLOC_REPORT");
+    FILE *fp = fopen(path != NULL && path[0] != '\0' ? path : KILO_ALLOC_DEFAULT_PATH, "w");
+    if (fp == NULL) { return; }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(fp, "# kilo %s allocations: live %lld peak_live %lld max_rss_kb %ld\n", KILO_VERSION,
+            (long long)editor_alloc.live, (long long)editor_alloc.peak_live, usage.ru_maxrss);
+    fprintf(fp, "# op ops allocs frees bytes allocs_per_op bytes_per_op peak_live\n");
+    for (unsigned op = 0; op < ALLOC_OPS; op++) {
+        alloc_stats_t *stats = &editor_alloc.stats[op];
+        uint64_t ops = stats->ops != 0 ? stats->ops : 1;
+        fprintf(fp, "op %s %llu %llu %llu %llu %.2f %.1f %lld\n", ALLOC_OP_NAMES[op],
+                (unsigned long long)stats->ops, (unsigned long long)stats->allocs,
+                (unsigned long long)stats->frees, (unsigned long long)stats->bytes,
+                (double)stats->allocs / ops, (double)stats->bytes / ops,
+                (long long)stats->peak_live);
+    }
+
+    fclose(fp);
 }
 
+#define ALLOC_ENTER(op) enum editor_alloc_op alloc_prev_op = editor_alloc_enter(op)
+#define ALLOC_LEAVE() editor_alloc_leave(alloc_prev_op)
+#define ALLOC_POOL_TRACK(size, usable) alloc_track_size(size, usable)
+#define ALLOC_POOL_RESIZE(old, size, usable) (editor_alloc.live -= (old), alloc_track_size(size, usable))
+#define ALLOC_POOL_UNTRACK(usable) alloc_untrack_size(usable)
+#else
+#define ALLOC_ENTER(op)
+#define ALLOC_LEAVE()
+#define ALLOC_POOL_TRACK(size, usable)
+#define ALLOC_POOL_RESIZE(old, size, usable)
+#define ALLOC_POOL_UNTRACK(usable)
+#endif
+
 void die(const char *str) {
     write(STDOUT_FILENO, "\x1b[2J", 4);
     write(STDOUT_FILENO, "\x1b[H", 3);
@@ -167,6 +737,23 @@ int get_cursor_position(unsigned *rows, unsigned *cols) {
     return 0;
 }
 
+/* Asks the terminal whether it knows synchronized output (DEC mode 2026) with DECRQM,
+ * followed by a cursor position report so terminals that ignore the query still answer */
+bool get_sync_output_support() {
+    char buf[64] = {0};
+    unsigned i = 0;
+    if (write(STDOUT_FILENO, "\x1b[?2026$p\x1b[6n", 13) != 13) { return false; }
+    while (i < sizeof(buf) - 1) {
+        if (read(STDIN_FILENO, &buf[i], 1) != 1) { break; }
+        if (buf[i] == 'R') { break; }
+        i += 1;
+    }
+
+    buf[i] = '\0';
+    char *reply = strstr(buf, "\x1b[?2026;");
+    return reply != NULL && (reply[8] == '1' || reply[8] == '2');
+}
+
 int get_window_size(unsigned *rows, unsigned *cols) {
     struct winsize ws;
 
@@ -180,202 +767,918 @@ int get_window_size(unsigned *rows, unsigned *cols) {
     }
 }
 
-bool is_seperator(char chr) {
-    return isspace(chr) || chr == '\0' || strchr(",.()+-/*=~%<>[]", chr) != NULL;
-}
+#define KILO_POOL_SLAB (1u << 20)
+#define KILO_POOL_HEADER 64
+#define KILO_POOL_MIN_SHIFT 4
+#define KILO_POOL_CLASSES 13
+#define KILO_POOL_LARGE KILO_POOL_CLASSES
+
+/* Row text, render and highlight come from a slab pool shared by all buffers. Slabs
+ * are KILO_POOL_SLAB aligned and start with a header, so the size class of a block
+ * is found by masking its address. Blocks of 16 bytes to 64KB are carved from slabs
+ * of their class and recycled through per-class free lists; larger blocks get a slab
+ * of their own. */
+typedef struct {
+    uint32_t cls;
+    size_t len;
+} pool_slab_t;
 
-void editor_update_highlight(editor_row_t *erow) {
-    erow->highlight = (unsigned char *)realloc(erow->highlight, erow->rsize);
-    memset(erow->highlight, HL_NORMAL, erow->rsize);
+typedef struct pool_block {
+    struct pool_block *next;
+} pool_block_t;
 
-    if (editor_cfg.syntax == NULL) { return; }
+typedef struct {
+    pool_block_t *free[KILO_POOL_CLASSES];
+    char *bump[KILO_POOL_CLASSES];
+    char *bump_end[KILO_POOL_CLASSES];
+    size_t mapped;
+} editor_pool_t;
 
-    char **keywords = editor_cfg.syntax->keywords;
+static editor_pool_t editor_pool;
 
-    char *scs = editor_cfg.syntax->singleline_comment_start;
-    char *mcs = editor_cfg.syntax->multiline_comment_start;
-    char *mce = editor_cfg.syntax->multiline_comment_end;
+pool_slab_t *pool_slab_of(void *ptr) {
+    return (pool_slab_t *)((uintptr_t)ptr & ~(uintptr_t)(KILO_POOL_SLAB - 1));
+}
 
-    unsigned scs_len = scs != NULL ? strlen(scs) : 0;
-    unsigned mcs_len = mcs != NULL ? strlen(mcs) : 0;
-    unsigned mce_len = mce != NULL ? strlen(mce) : 0;
+size_t pool_block_size(void *ptr) {
+    pool_slab_t *slab = pool_slab_of(ptr);
+    return slab->cls == KILO_POOL_LARGE ? slab->len - KILO_POOL_HEADER : (size_t)1 << (slab->cls + KILO_POOL_MIN_SHIFT);
+}
 
-    bool prev_sep = true;
-    char in_string = '\0';
-    char in_comment = (erow->idx > 0 && editor_cfg.erows[erow->idx - 1].hl_open_comment);
+/* Maps len bytes aligned to KILO_POOL_SLAB by over-mapping and trimming the ends */
+pool_slab_t *pool_map(size_t len, uint32_t cls) {
+    size_t span = len + KILO_POOL_SLAB;
+    char *raw = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) { die("pool_map :: mmap"); }
+    char *base = (char *)(((uintptr_t)raw + KILO_POOL_SLAB - 1) & ~(uintptr_t)(KILO_POOL_SLAB - 1));
+    if (base > raw) { munmap(raw, base - raw); }
+    if (&raw[span] > &base[len]) { munmap(&base[len], &raw[span] - &base[len]); }
+
+    pool_slab_t *slab = (pool_slab_t *)base;
+    slab->cls = cls;
+    slab->len = len;
+    editor_pool.mapped += len;
+    return slab;
+}
 
-    unsigned i = 0;
-    while (i < erow->rsize) {
-        char chr = erow->render[i];
-        unsigned char prev_hl = (i > 0) ? erow->highlight[i - 1] : HL_NORMAL;
+void *pool_block_alloc(size_t size) {
+    if (size > ((size_t)1 << (KILO_POOL_CLASSES - 1 + KILO_POOL_MIN_SHIFT))) {
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t len = (KILO_POOL_HEADER + size + page - 1) / page * page;
+        pool_slab_t *slab = pool_map(len, KILO_POOL_LARGE);
+        editor_cfg.buf->pool_bytes += len - KILO_POOL_HEADER;
+        return (char *)slab + KILO_POOL_HEADER;
+    }
 
-        /* test */
-        if (scs_len > 0 && !in_string && !in_comment) {
-            if (!strncmp(&erow->render[i], scs, scs_len)) {
-                memset(&erow->highlight[i], HL_COMMENT, erow->rsize - i);
-                break;
-            }
-        }
+    uint32_t cls = 0;
+    while (((size_t)1 << (cls + KILO_POOL_MIN_SHIFT)) < size) { cls += 1; }
+    size_t block = (size_t)1 << (cls + KILO_POOL_MIN_SHIFT);
+    editor_cfg.buf->pool_bytes += block;
 
-        if (mcs_len > 0 && mce_len > 0 && !in_string) {
-            if (in_comment) {
-                erow->highlight[i] = HL_ML_COMMENT;
-                if (!strncmp(&erow->render[i], mce, mce_len)) {
-                    memset(&erow->highlight[i], HL_ML_COMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = false;
-                    prev_sep = true;
-                    continue;
-                } else {
-                    i += 1;
-                    continue;
-                }
-            } else if (!strncmp(&erow->render[i], mcs, mcs_len)) {
-                memset(&erow->highlight[i], HL_ML_COMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = true;
-            }
-        }
+    pool_block_t *free_block = editor_pool.free[cls];
+    if (free_block != NULL) {
+        editor_pool.free[cls] = free_block->next;
+        return free_block;
+    }
 
-        if (editor_cfg.syntax->flags & HL_HIGHLIGHT_STRINGS) {
-            if (in_string != '\0') {
-                erow->highlight[i] = HL_STRING;
+    if (editor_pool.bump[cls] == editor_pool.bump_end[cls]) {
+        char *slab = (char *)pool_map(KILO_POOL_SLAB, cls);
+        size_t first = block > KILO_POOL_HEADER ? block : KILO_POOL_HEADER;
+        editor_pool.bump[cls] = &slab[first];
+        editor_pool.bump_end[cls] = &slab[KILO_POOL_SLAB];
+    }
 
-                if (chr == '\\' && i + 1 < erow->rsize) {
-                    erow->highlight[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
+    void *ptr = editor_pool.bump[cls];
+    editor_pool.bump[cls] += block;
+    return ptr;
+}
 
-                if (chr == in_string) { in_string = false; }
-                i += 1;
-                prev_sep = true;
-                continue;
-            } else {
-                if (chr == '"' || chr == '\'') {
-                    in_string = chr;
-                    erow->highlight[i] = HL_STRING;
-                    i += 1;
-                    continue;
-                }
-            }
-        }
+void pool_block_free(void *ptr) {
+    pool_slab_t *slab = pool_slab_of(ptr);
+    editor_cfg.buf->pool_bytes -= pool_block_size(ptr);
+    if (slab->cls == KILO_POOL_LARGE) {
+        editor_pool.mapped -= slab->len;
+        munmap(slab, slab->len);
+        return;
+    }
 
-        if (editor_cfg.syntax->flags & HL_HIGHLIGHT_NUMBERS) {
-            if ((isdigit(chr) && (prev_sep || prev_hl == HL_NUMBER)) ||
-                (chr == '.' && prev_hl == HL_NUMBER)) {
-                erow->highlight[i] = HL_NUMBER;
-                i += 1;
-                prev_sep = false;
-                continue;
-            }
-        }
+    pool_block_t *block = ptr;
+    block->next = editor_pool.free[slab->cls];
+    editor_pool.free[slab->cls] = block;
+}
 
-        if (prev_sep) {
-            unsigned j = 0;
-            for (; keywords[j] != NULL; j++) {
-                unsigned klen = strlen(keywords[j]);
-                bool kw2 = keywords[j][klen - 1] == '|';
-
-                if (kw2) { klen -= 1; }
-
-                if (!strncmp(&erow->render[i], keywords[j], klen) &&
-                    is_seperator(erow->render[i + klen])) {
-                    memset(&erow->highlight[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
-                    break;
-                }
-            }
+void *editor_pool_alloc(size_t size) {
+    void *ptr = pool_block_alloc(size);
+    ALLOC_POOL_TRACK(size, pool_block_size(ptr));
+    return ptr;
+}
 
-            if (keywords[j] != NULL) {
-                prev_sep = false;
-                continue;
-            }
-        }
+void editor_pool_free(void *ptr) {
+    if (ptr == NULL) { return; }
+    ALLOC_POOL_UNTRACK(pool_block_size(ptr));
+    pool_block_free(ptr);
+}
 
-        prev_sep = is_seperator(chr);
-        i += 1;
+/* Grows or shrinks a block, keeping it in place while the new size still fits its
+ * class, which makes the common one-byte growth of a row free. The tracking build
+ * counts every call as one allocation, as it does for realloc. */
+void *editor_pool_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) { return editor_pool_alloc(size); }
+    size_t cap = pool_block_size(ptr);
+    void *grown = ptr;
+    if (size > cap || (size <= cap / 4 && cap != (1u << KILO_POOL_MIN_SHIFT))) {
+        grown = pool_block_alloc(size);
+        memcpy(grown, ptr, size < cap ? size : cap);
+        pool_block_free(ptr);
     }
 
-    bool changed = (erow->hl_open_comment != in_comment);
-    erow->hl_open_comment = in_comment;
+    ALLOC_POOL_RESIZE(cap, size, pool_block_size(grown));
+    return grown;
+}
 
-    if (changed && erow->idx + 1 < editor_cfg.num_erows) {
-        editor_update_highlight(&editor_cfg.erows[erow->idx + 1]);
-    }
+size_t editor_buffer_memory(editor_buffer_t *buf) {
+    return buf->pool_bytes + buf->erows_cap * sizeof(editor_row_t) + buf->undo.arena_cap +
+           buf->undo.cap * sizeof(undo_record_t) + buf->journal.pending.cap + sizeof(editor_buffer_t);
 }
 
-int editor_highlight_to_colour(int hl) {
-    switch (hl) {
-        case HL_COMMENT:
-        case HL_ML_COMMENT: return 36;
-        case HL_KEYWORD1: return 33;
+unsigned editor_format_bytes(char *buf, size_t size, size_t bytes) {
+    if (bytes < 1024) { return snprintf(buf, size, "%zuB", bytes); }
+    if (bytes < 1024 * 1024) { return snprintf(buf, size, "%.1fK", bytes / 1024.0); }
+    return snprintf(buf, size, "%.1fM", bytes / (1024.0 * 1024.0));
+}
+
+unsigned editor_buffer_index() {
+    unsigned idx = 0;
+    while (idx < editor_cfg.num_buffers && editor_cfg.buffers[idx] != editor_cfg.buf) { idx += 1; }
+    return idx;
+}
+
+bool is_seperator(char chr) {
+    return isspace((unsigned char)chr) || chr == '\0' || strchr(",.()+-/*=~%<>[]", chr) != NULL;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define UTF8_INVALID 0xffffffffu
+
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} utf8_range_t;
+
+/* Combining marks and other code points that take no column of their own */
+static const utf8_range_t UTF8_ZERO_WIDTH[] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x05bf, 0x05bf}, {0x05c1, 0x05c2},
+    {0x05c4, 0x05c5}, {0x05c7, 0x05c7}, {0x0610, 0x061a}, {0x064b, 0x065f}, {0x0670, 0x0670},
+    {0x06d6, 0x06dc}, {0x06df, 0x06e4}, {0x06e7, 0x06e8}, {0x06ea, 0x06ed}, {0x0711, 0x0711},
+    {0x0730, 0x074a}, {0x07a6, 0x07b0}, {0x0816, 0x082d}, {0x0859, 0x085b}, {0x08d3, 0x08ff},
+    {0x0900, 0x0902}, {0x093a, 0x093a}, {0x093c, 0x093c}, {0x0941, 0x0948}, {0x094d, 0x094d},
+    {0x0951, 0x0957}, {0x0962, 0x0963}, {0x0981, 0x0981}, {0x09bc, 0x09bc}, {0x09c1, 0x09c4},
+    {0x09cd, 0x09cd}, {0x0a01, 0x0a02}, {0x0a3c, 0x0a3c}, {0x0a41, 0x0a51}, {0x0e31, 0x0e31},
+    {0x0e34, 0x0e3a}, {0x0e47, 0x0e4e}, {0x0eb1, 0x0eb1}, {0x0eb4, 0x0ebc}, {0x0ec8, 0x0ecd},
+    {0x1160, 0x11ff}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f}, {0x202a, 0x202e},
+    {0x2060, 0x2064}, {0x20d0, 0x20ff}, {0x302a, 0x302d}, {0x3099, 0x309a}, {0xfe00, 0xfe0f},
+    {0xfe20, 0xfe2f}, {0xfeff, 0xfeff}, {0x1d167, 0x1d169}, {0xe0100, 0xe01ef},
+};
+
+/* East Asian wide and fullwidth characters, and emoji presented as wide */
+static const utf8_range_t UTF8_WIDE[] = {
+    {0x1100, 0x115f}, {0x231a, 0x231b}, {0x2329, 0x232a}, {0x23e9, 0x23ec}, {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3}, {0x25fd, 0x25fe}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267f, 0x267f},
+    {0x2693, 0x2693}, {0x26a1, 0x26a1}, {0x26aa, 0x26ab}, {0x26bd, 0x26be}, {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce}, {0x26d4, 0x26d4}, {0x26ea, 0x26ea}, {0x26f2, 0x26f3}, {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa}, {0x26fd, 0x26fd}, {0x2705, 0x2705}, {0x270a, 0x270b}, {0x2728, 0x2728},
+    {0x274c, 0x274c}, {0x274e, 0x274e}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+    {0x27b0, 0x27b0}, {0x27bf, 0x27bf}, {0x2b1b, 0x2b1c}, {0x2b50, 0x2b50}, {0x2b55, 0x2b55},
+    {0x2e80, 0x303e}, {0x3041, 0x3247}, {0x3250, 0x4dbf}, {0x4e00, 0xa4cf}, {0xa960, 0xa97f},
+    {0xac00, 0xd7a3}, {0xf900, 0xfaff}, {0xfe10, 0xfe19}, {0xfe30, 0xfe6f}, {0xff00, 0xff60},
+    {0xffe0, 0xffe6}, {0x16fe0, 0x16fe4}, {0x17000, 0x18cff}, {0x1b000, 0x1b2ff}, {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf}, {0x1f18e, 0x1f18e}, {0x1f191, 0x1f19a}, {0x1f200, 0x1f251}, {0x1f300, 0x1f64f},
+    {0x1f680, 0x1f6ff}, {0x1f7e0, 0x1f7eb}, {0x1f90c, 0x1f9ff}, {0x1fa70, 0x1faff}, {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd},
+};
+
+/* Length of the leading run of ASCII bytes. SSE2 checks the sign bits of 16 bytes at
+ * once; other targets fall back to testing a 64-bit word at a time. */
+size_t utf8_ascii_prefix(const char *str, size_t len) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)&str[i]));
+        if (mask != 0) { return i + __builtin_ctz(mask); }
+    }
+#else
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word = 0;
+        memcpy(&word, &str[i], sizeof(word));
+        if (word & 0x8080808080808080ull) { break; }
+    }
+#endif
+    while (i < len && (unsigned char)str[i] < 0x80) { i += 1; }
+    return i;
+}
+
+/* Decodes the code point at str and returns the bytes it spans. A malformed, overlong
+ * or truncated sequence decodes as a single byte with *cp set to UTF8_INVALID. */
+unsigned utf8_decode(const char *str, size_t len, uint32_t *cp) {
+    static const uint32_t min_value[] = {0, 0, 0x80, 0x800, 0x10000};
+    const unsigned char *bytes = (const unsigned char *)str;
+    *cp = bytes[0];
+    if (bytes[0] < 0x80) { return 1; }
+
+    unsigned n = bytes[0] >= 0xf0 ? 4 : bytes[0] >= 0xe0 ? 3 : bytes[0] >= 0xc2 ? 2 : 0;
+    if (n == 0 || bytes[0] > 0xf4 || n > len) {
+        *cp = UTF8_INVALID;
+        return 1;
+    }
+
+    uint32_t value = bytes[0] & (0x7f >> n);
+    for (unsigned k = 1; k < n; k++) {
+        if ((bytes[k] & 0xc0) != 0x80) {
+            *cp = UTF8_INVALID;
+            return 1;
+        }
+        value = (value << 6) | (bytes[k] & 0x3f);
+    }
+
+    if (value < min_value[n] || value > 0x10ffff || (value >= 0xd800 && value <= 0xdfff)) {
+        *cp = UTF8_INVALID;
+        return 1;
+    }
+
+    *cp = value;
+    return n;
+}
+
+bool utf8_in_table(uint32_t cp, const utf8_range_t *table, size_t count) {
+    size_t lo = 0;
+    size_t hi = count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cp > table[mid].last) {
+            lo = mid + 1;
+        } else if (cp < table[mid].first) {
+            hi = mid;
+        } else {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Terminal columns a code point takes. Controls and malformed bytes are drawn as a
+ * one column symbol. */
+unsigned utf8_width(uint32_t cp) {
+    if (cp == UTF8_INVALID || cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) { return 1; }
+    if (cp < 0x300) { return 1; }
+    if (utf8_in_table(cp, UTF8_ZERO_WIDTH, sizeof(UTF8_ZERO_WIDTH) / sizeof(UTF8_ZERO_WIDTH[0]))) { return 0; }
+    if (utf8_in_table(cp, UTF8_WIDE, sizeof(UTF8_WIDE) / sizeof(UTF8_WIDE[0]))) { return 2; }
+    return 1;
+}
+
+bool utf8_is_continuation(char chr) {
+    return ((unsigned char)chr & 0xc0) == 0x80;
+}
+
+uint32_t syntax_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) { hash = (hash ^ (unsigned char)key[i]) * 16777619u; }
+    return hash;
+}
+
+/* Probes an open-addressed table of slots, a power of two in size, for a key */
+const syntax_slot_t *editor_syntax_lookup(const syntax_slot_t *table, uint32_t slots, const char *key, size_t len) {
+    if (slots == 0) { return NULL; }
+    uint32_t hash = syntax_hash(key, len);
+    uint32_t idx = hash & (slots - 1);
+    for (uint32_t n = 0; n < slots && table[idx].str != 0; n++, idx = (idx + 1) & (slots - 1)) {
+        const syntax_slot_t *slot = &table[idx];
+        if (slot->hash == hash && slot->len == len && slot->str + len < editor_syntax_db.hdr->strings_len &&
+            memcmp(&editor_syntax_db.strings[slot->str], key, len) == 0) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+bool editor_syntax_match(const char *line, size_t len, size_t i, const char *delim, size_t delim_len) {
+    return delim_len > 0 && len - i >= delim_len && memcmp(&line[i], delim, delim_len) == 0;
+}
+
+/* Whether a line starting in the given comment state ends inside a multi-line
+ * comment. Tracks only the string and comment rules of editor_update_highlight, so
+ * rows that are not rendered yet can keep their state current. */
+bool editor_comment_state(const char *line, size_t len, bool in_comment) {
+    editor_syntax *syntax = editor_cfg.buf->syntax;
+    if (syntax == NULL || syntax->mcs_len == 0 || syntax->mce_len == 0) { return false; }
+
+    const char *scs = syntax->singleline_comment_start;
+    const char *mcs = syntax->multiline_comment_start;
+    const char *mce = syntax->multiline_comment_end;
+    size_t scs_len = syntax->scs_len;
+    size_t mcs_len = syntax->mcs_len;
+    size_t mce_len = syntax->mce_len;
+
+    char in_string = '\0';
+    size_t i = 0;
+    while (i < len) {
+        char chr = line[i];
+        if (in_comment) {
+            if (editor_syntax_match(line, len, i, mce, mce_len)) {
+                i += mce_len;
+                in_comment = false;
+            } else {
+                i += 1;
+            }
+            continue;
+        }
+
+        if (in_string != '\0') {
+            if (chr == '\\' && i + 1 < len) {
+                i += 2;
+                continue;
+            }
+
+            if (chr == in_string) { in_string = '\0'; }
+            i += 1;
+            continue;
+        }
+
+        if (editor_syntax_match(line, len, i, scs, scs_len)) { return false; }
+        if (editor_syntax_match(line, len, i, mcs, mcs_len)) {
+            i += mcs_len;
+            in_comment = true;
+            continue;
+        }
+
+        if ((syntax->flags & HL_HIGHLIGHT_STRINGS) && (chr == '"' || chr == '\'')) { in_string = chr; }
+        i += 1;
+    }
+
+    return in_comment;
+}
+
+void editor_update_highlight(editor_row_t *erow) {
+    erow->highlight = (unsigned char *)editor_pool_realloc(erow->highlight, erow->rsize);
+    memset(erow->highlight, HL_NORMAL, erow->rsize);
+
+    editor_syntax *syntax = editor_cfg.buf->syntax;
+    if (syntax == NULL) { return; }
+
+    const char *scs = syntax->singleline_comment_start;
+    const char *mcs = syntax->multiline_comment_start;
+    const char *mce = syntax->multiline_comment_end;
+
+    size_t scs_len = syntax->scs_len;
+    size_t mcs_len = syntax->mcs_len;
+    size_t mce_len = syntax->mce_len;
+
+    bool prev_sep = true;
+    char in_string = '\0';
+    char in_comment = (erow->idx > 0 && editor_cfg.buf->erows[erow->idx - 1].hl_open_comment);
+
+    size_t i = 0;
+    while (i < erow->rsize) {
+        char chr = erow->render[i];
+        unsigned char prev_hl = (i > 0) ? erow->highlight[i - 1] : HL_NORMAL;
+
+        /* test */
+        if (scs_len > 0 && !in_string && !in_comment) {
+            if (!strncmp(&erow->render[i], scs, scs_len)) {
+                memset(&erow->highlight[i], HL_COMMENT, erow->rsize - i);
+                break;
+            }
+        }
+
+        if (mcs_len > 0 && mce_len > 0 && !in_string) {
+            if (in_comment) {
+                erow->highlight[i] = HL_ML_COMMENT;
+                if (!strncmp(&erow->render[i], mce, mce_len)) {
+                    memset(&erow->highlight[i], HL_ML_COMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = false;
+                    prev_sep = true;
+                    continue;
+                } else {
+                    i += 1;
+                    continue;
+                }
+            } else if (!strncmp(&erow->render[i], mcs, mcs_len)) {
+                memset(&erow->highlight[i], HL_ML_COMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = true;
+                continue;
+            }
+        }
+
+        if (syntax->flags & HL_HIGHLIGHT_STRINGS) {
+            if (in_string != '\0') {
+                erow->highlight[i] = HL_STRING;
+
+                if (chr == '\\' && i + 1 < erow->rsize) {
+                    erow->highlight[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+
+                if (chr == in_string) { in_string = false; }
+                i += 1;
+                prev_sep = true;
+                continue;
+            } else {
+                if (chr == '"' || chr == '\'') {
+                    in_string = chr;
+                    erow->highlight[i] = HL_STRING;
+                    i += 1;
+                    continue;
+                }
+            }
+        }
+
+        if (syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+            if ((isdigit((unsigned char)chr) && (prev_sep || prev_hl == HL_NUMBER)) ||
+                (chr == '.' && prev_hl == HL_NUMBER)) {
+                erow->highlight[i] = HL_NUMBER;
+                i += 1;
+                prev_sep = false;
+                continue;
+            }
+        }
+
+        if (prev_sep) {
+            size_t end = i;
+            while (end < erow->rsize && !is_seperator(erow->render[end])) { end += 1; }
+            const syntax_slot_t *keyword = end > i
+                ? editor_syntax_lookup(syntax->keywords, syntax->keyword_slots, &erow->render[i], end - i)
+                : NULL;
+            if (keyword != NULL) {
+                memset(&erow->highlight[i], keyword->value == 2 ? HL_KEYWORD2 : HL_KEYWORD1, end - i);
+                i = end;
+                prev_sep = false;
+                continue;
+            }
+        }
+
+        prev_sep = is_seperator(chr);
+        i += 1;
+    }
+
+    bool changed = (erow->hl_open_comment != in_comment);
+    erow->hl_open_comment = in_comment;
+
+    for (size_t j = erow->idx + 1; changed && j < editor_cfg.buf->num_erows; j++) {
+        editor_row_t *next = &editor_cfg.buf->erows[j];
+        if (next->render != NULL) {
+            editor_update_highlight(next);
+            break;
+        }
+
+        bool open = editor_comment_state(next->chars, next->size, editor_cfg.buf->erows[j - 1].hl_open_comment);
+        changed = open != next->hl_open_comment;
+        next->hl_open_comment = open;
+    }
+}
+
+int editor_highlight_to_colour(int hl) {
+    switch (hl) {
+        case HL_COMMENT:
+        case HL_ML_COMMENT: return 36;
+        case HL_KEYWORD1: return 33;
         case HL_KEYWORD2: return 32;
         case HL_STRING: return 35;
         case HL_NUMBER: return 31;
         case HL_MATCH: return 34;
+        case HL_NORMAL: return 39;
         default: return 37;
     }
 }
 
-void editor_select_syntax() {
-    editor_cfg.syntax = NULL;
-    if (editor_cfg.filename == NULL) { return; }
-    char *ext = strrchr(editor_cfg.filename, '.');
-
-    for (unsigned j = 0; j < HLDB_ENTRIES; j++) {
-        editor_syntax *syntax = &HLDB[j];
-        unsigned i = 0;
-        while (syntax->filematch[i] != NULL) {
-            bool is_ext = syntax->filematch[i][0] == '.';
-            if ((is_ext && ext != NULL && strcmp(ext, syntax->filematch[i]) == 0) || (!is_ext && strstr(editor_cfg.filename, syntax->filematch[i]))) {
-                editor_cfg.syntax = syntax;
-                for (unsigned filerow = 0; filerow < editor_cfg.num_erows; filerow++) {
-                    editor_update_highlight(&editor_cfg.erows[filerow]);
-                }
-                return;
+// Forward declare editor_update_row()
+void editor_update_row(editor_row_t *erow);
+
+// Forward declare editor_set_status_msg()
+void editor_set_status_msg(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+typedef struct {
+    char *word;
+    uint32_t value;
+} syntax_word_t;
+
+/* A parsed .syn file: keywords carry their class, matches are extensions and names */
+typedef struct {
+    char *name;
+    char *singleline_comment_start;
+    char *multiline_comment_start;
+    char *multiline_comment_end;
+    unsigned flags;
+    syntax_word_t *keywords;
+    size_t num_keywords;
+    syntax_word_t *matches;
+    size_t num_matches;
+} syntax_def_t;
+
+void syntax_words_push(syntax_word_t **words, size_t *count, const char *word, uint32_t value) {
+    *words = realloc(*words, (*count + 1) * sizeof(syntax_word_t));
+    (*words)[*count].word = strdup(word);
+    (*words)[*count].value = value;
+    *count += 1;
+}
+
+void editor_syntax_def_free(syntax_def_t *def) {
+    for (size_t j = 0; j < def->num_keywords; j++) { free(def->keywords[j].word); }
+    for (size_t j = 0; j < def->num_matches; j++) { free(def->matches[j].word); }
+    free(def->keywords);
+    free(def->matches);
+    free(def->name);
+    free(def->singleline_comment_start);
+    free(def->multiline_comment_start);
+    free(def->multiline_comment_end);
+    memset(def, 0, sizeof(*def));
+}
+
+/* Parses a .syn definition: one "key value..." line per setting, '#' lines are
+ * comments. Problems are reported against origin on stderr. */
+bool editor_syntax_parse(syntax_def_t *def, const char *text, size_t len, const char *origin) {
+    char *copy = strndup(text, len);
+    char *line = copy;
+    size_t line_no = 0;
+    bool ok = true;
+    while (ok && line != NULL) {
+        char *next = strchr(line, '\n');
+        if (next != NULL) { *next++ = '\0'; }
+        line_no += 1;
+
+        char *save = NULL;
+        char *key = strtok_r(line, " \t\r", &save);
+        line = next;
+        if (key == NULL || key[0] == '#') { continue; }
+
+        char *value = NULL;
+        size_t values = 0;
+        char **single = NULL;
+        if (strcmp(key, "name") == 0) {
+            single = &def->name;
+        } else if (strcmp(key, "comment") == 0) {
+            single = &def->singleline_comment_start;
+        } else if (strcmp(key, "comment_start") == 0) {
+            single = &def->multiline_comment_start;
+        } else if (strcmp(key, "comment_end") == 0) {
+            single = &def->multiline_comment_end;
+        }
+
+        while (ok && (value = strtok_r(NULL, " \t\r", &save)) != NULL) {
+            values += 1;
+            if (single != NULL) {
+                free(*single);
+                *single = strdup(value);
+            } else if (strcmp(key, "extensions") == 0 || strcmp(key, "files") == 0) {
+                syntax_words_push(&def->matches, &def->num_matches, value, 0);
+            } else if (strcmp(key, "keywords") == 0 || strcmp(key, "types") == 0) {
+                syntax_words_push(&def->keywords, &def->num_keywords, value, key[0] == 't' ? 2 : 1);
+            } else if (strcmp(key, "flags") == 0 && strcmp(value, "numbers") == 0) {
+                def->flags |= HL_HIGHLIGHT_NUMBERS;
+            } else if (strcmp(key, "flags") == 0 && strcmp(value, "strings") == 0) {
+                def->flags |= HL_HIGHLIGHT_STRINGS;
+            } else {
+                bool flag = strcmp(key, "flags") == 0;
+                fprintf(stderr, "%s:%zu: unknown %s '%s'\n", origin, line_no, flag ? "flag" : "key", flag ? value : key);
+                ok = false;
             }
+        }
 
-            i += 1;
+        if (ok && single != NULL && values != 1) {
+            fprintf(stderr, "%s:%zu: %s takes one value\n", origin, line_no, key);
+            ok = false;
+        } else if (ok && single == &def->name && strlen(def->name) > KILO_SYNTAX_NAME_MAX) {
+            fprintf(stderr, "%s:%zu: name is longer than %d bytes\n", origin, line_no, KILO_SYNTAX_NAME_MAX);
+            ok = false;
+        }
+    }
+
+    if (ok && def->name == NULL) {
+        fprintf(stderr, "%s: missing name\n", origin);
+        ok = false;
+    }
+
+    free(copy);
+    return ok;
+}
+
+uint32_t syntax_string(abuf *strings, const char *str) {
+    if (str == NULL) { return 0; }
+    uint32_t offset = strings->len;
+    abuf_append(strings, str, strlen(str) + 1);
+    return offset;
+}
+
+/* Appends a hash table of words to tables, at most half full so probes stay short */
+uint32_t syntax_table(abuf *tables, abuf *strings, size_t base, const syntax_word_t *words, size_t count,
+                      uint32_t *slots_out) {
+    uint32_t slots = 8;
+    while (slots < count * 2) { slots *= 2; }
+    syntax_slot_t *table = calloc(slots, sizeof(syntax_slot_t));
+    for (size_t j = 0; j < count; j++) {
+        size_t len = strlen(words[j].word);
+        uint32_t hash = syntax_hash(words[j].word, len);
+        uint32_t idx = hash & (slots - 1);
+        while (table[idx].str != 0 && !(table[idx].len == len && memcmp(&strings->data[table[idx].str], words[j].word, len) == 0)) {
+            idx = (idx + 1) & (slots - 1);
+        }
+
+        if (table[idx].str != 0) { continue; }
+        table[idx] = (syntax_slot_t){hash, syntax_string(strings, words[j].word), len, words[j].value};
+    }
+
+    uint32_t offset = base + tables->len;
+    abuf_append(tables, (const char *)table, slots * sizeof(syntax_slot_t));
+    free(table);
+    *slots_out = slots;
+    return offset;
+}
+
+/* Lays out parsed definitions as a bundle. An extension or name claimed by several
+ * languages goes to the first. */
+void editor_syntax_build(abuf *out, syntax_def_t *defs, size_t count) {
+    abuf tables = ABUF_INIT;
+    abuf strings = ABUF_INIT;
+    abuf_append(&strings, "", 1);
+    size_t base = sizeof(syntax_bundle_header_t);
+    syntax_bundle_lang_t *langs = calloc(count, sizeof(syntax_bundle_lang_t));
+    abuf_append(&tables, (const char *)langs, count * sizeof(syntax_bundle_lang_t));
+
+    size_t num_matches = 0;
+    for (size_t j = 0; j < count; j++) { num_matches += defs[j].num_matches; }
+    syntax_word_t *matches = calloc(num_matches + 1, sizeof(syntax_word_t));
+    num_matches = 0;
+    for (size_t j = 0; j < count; j++) {
+        for (size_t k = 0; k < defs[j].num_matches; k++) { matches[num_matches++] = (syntax_word_t){defs[j].matches[k].word, j}; }
+    }
+
+    syntax_bundle_header_t hdr = {0};
+    memcpy(hdr.magic, KILO_SYNTAX_MAGIC, sizeof(hdr.magic));
+    hdr.num_langs = count;
+    hdr.langs = base;
+    hdr.matches = syntax_table(&tables, &strings, base, matches, num_matches, &hdr.match_slots);
+    free(matches);
+
+    for (size_t j = 0; j < count; j++) {
+        langs[j].name = syntax_string(&strings, defs[j].name);
+        langs[j].singleline_comment_start = syntax_string(&strings, defs[j].singleline_comment_start);
+        langs[j].multiline_comment_start = syntax_string(&strings, defs[j].multiline_comment_start);
+        langs[j].multiline_comment_end = syntax_string(&strings, defs[j].multiline_comment_end);
+        langs[j].flags = defs[j].flags;
+        langs[j].keywords = syntax_table(&tables, &strings, base, defs[j].keywords, defs[j].num_keywords,
+                                         &langs[j].keyword_slots);
+    }
+
+    memcpy(tables.data, langs, count * sizeof(syntax_bundle_lang_t));
+    hdr.strings = base + tables.len;
+    hdr.strings_len = strings.len;
+    hdr.size = hdr.strings + strings.len;
+    abuf_append(out, (const char *)&hdr, sizeof(hdr));
+    abuf_append(out, tables.data, tables.len);
+    abuf_append(out, strings.data, strings.len);
+    abuf_free(&tables);
+    abuf_free(&strings);
+    free(langs);
+}
+
+/* Adopts a bundle after checking its header and that its tables and strings lie
+ * inside it. Languages are only checked when first used, so startup does not walk
+ * them however many the bundle holds. */
+bool editor_syntax_map(const char *data, size_t len) {
+    const syntax_bundle_header_t *hdr = (const syntax_bundle_header_t *)data;
+    if (len < sizeof(*hdr) || memcmp(hdr->magic, KILO_SYNTAX_MAGIC, sizeof(hdr->magic)) != 0 || hdr->size != len ||
+        (uint64_t)hdr->langs + (uint64_t)hdr->num_langs * sizeof(syntax_bundle_lang_t) > len ||
+        (uint64_t)hdr->matches + (uint64_t)hdr->match_slots * sizeof(syntax_slot_t) > len ||
+        (hdr->match_slots & (hdr->match_slots - 1)) != 0 || hdr->langs % sizeof(uint32_t) != 0 ||
+        hdr->matches % sizeof(uint32_t) != 0 ||
+        hdr->strings_len == 0 || (uint64_t)hdr->strings + hdr->strings_len > len ||
+        data[hdr->strings + hdr->strings_len - 1] != '\0') {
+        return false;
+    }
+
+    editor_syntax_db.data = data;
+    editor_syntax_db.len = len;
+    editor_syntax_db.hdr = hdr;
+    editor_syntax_db.strings = &data[hdr->strings];
+    editor_syntax_db.langs = calloc(hdr->num_langs, sizeof(editor_syntax));
+    return true;
+}
+
+char *editor_syntax_path() {
+    char *path = getenv("KILO_SYNTAX");
+    if (path != NULL && path[0] != '\0') { return strdup(path); }
+
+    char *data = getenv("XDG_DATA_HOME");
+    char *home = getenv("HOME");
+    char buf[PATH_MAX] = {0};
+    if (data != NULL && data[0] != '\0') {
+        snprintf(buf, sizeof(buf), "%s/kilo/syntax.bundle", data);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(buf, sizeof(buf), "%s/.local/share/kilo/syntax.bundle", home);
+    } else {
+        return NULL;
+    }
+
+    return strdup(buf);
+}
+
+/* Maps the installed syntax bundle, or compiles the built-in C definition when there
+ * is none or it is damaged */
+void editor_syntax_load() {
+    char *path = editor_syntax_path();
+    int fd = path != NULL ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED && editor_syntax_map(data, st.st_size)) {
+            editor_syntax_db.mapped = true;
+        } else {
+            if (data != MAP_FAILED) { munmap(data, st.st_size); }
+            editor_set_status_msg("Syntax bundle %s is not valid; using built-in C", path);
+        }
+    }
+
+    if (fd != -1) { close(fd); }
+    free(path);
+    if (editor_syntax_db.hdr != NULL) { return; }
+
+    syntax_def_t def = {0};
+    abuf bundle = ABUF_INIT;
+    editor_syntax_parse(&def, C_HL_SYN, sizeof(C_HL_SYN) - 1, "built-in");
+    editor_syntax_build(&bundle, &def, 1);
+    editor_syntax_def_free(&def);
+    editor_syntax_map(bundle.data, bundle.len);
+}
+
+/* Resolves a language of the bundle on first use */
+editor_syntax *editor_syntax_get(uint32_t idx) {
+    const syntax_bundle_header_t *hdr = editor_syntax_db.hdr;
+    if (idx >= hdr->num_langs) { return NULL; }
+    editor_syntax *syntax = &editor_syntax_db.langs[idx];
+    if (syntax->filetype != NULL) { return syntax; }
+
+    const syntax_bundle_lang_t *lang = &((const syntax_bundle_lang_t *)&editor_syntax_db.data[hdr->langs])[idx];
+    if (lang->name == 0 || lang->name >= hdr->strings_len ||
+        strnlen(&editor_syntax_db.strings[lang->name], KILO_SYNTAX_NAME_MAX + 1) > KILO_SYNTAX_NAME_MAX ||
+        lang->singleline_comment_start >= hdr->strings_len ||
+        lang->multiline_comment_start >= hdr->strings_len || lang->multiline_comment_end >= hdr->strings_len ||
+        (uint64_t)lang->keywords + (uint64_t)lang->keyword_slots * sizeof(syntax_slot_t) > editor_syntax_db.len ||
+        (lang->keyword_slots & (lang->keyword_slots - 1)) != 0 || lang->keywords % sizeof(uint32_t) != 0) {
+        return NULL;
+    }
+
+    const char *strings = editor_syntax_db.strings;
+    syntax->singleline_comment_start = lang->singleline_comment_start != 0 ? &strings[lang->singleline_comment_start] : NULL;
+    syntax->multiline_comment_start = lang->multiline_comment_start != 0 ? &strings[lang->multiline_comment_start] : NULL;
+    syntax->multiline_comment_end = lang->multiline_comment_end != 0 ? &strings[lang->multiline_comment_end] : NULL;
+    syntax->scs_len = syntax->singleline_comment_start != NULL ? strlen(syntax->singleline_comment_start) : 0;
+    syntax->mcs_len = syntax->multiline_comment_start != NULL ? strlen(syntax->multiline_comment_start) : 0;
+    syntax->mce_len = syntax->multiline_comment_end != NULL ? strlen(syntax->multiline_comment_end) : 0;
+    syntax->flags = lang->flags;
+    syntax->keywords = (const syntax_slot_t *)&editor_syntax_db.data[lang->keywords];
+    syntax->keyword_slots = lang->keyword_slots;
+    syntax->filetype = &strings[lang->name];
+    return syntax;
+}
+
+/* Picks the language by file extension, then by file name, with one hash probe each */
+void editor_select_syntax() {
+    editor_cfg.buf->syntax = NULL;
+    if (editor_cfg.buf->filename == NULL) { return; }
+    if (editor_syntax_db.hdr == NULL) { editor_syntax_load(); }
+
+    const syntax_bundle_header_t *hdr = editor_syntax_db.hdr;
+    const syntax_slot_t *matches = (const syntax_slot_t *)&editor_syntax_db.data[hdr->matches];
+    const char *base = strrchr(editor_cfg.buf->filename, '/');
+    base = base != NULL ? base + 1 : editor_cfg.buf->filename;
+    const char *ext = strrchr(base, '.');
+    const syntax_slot_t *match = ext != NULL ? editor_syntax_lookup(matches, hdr->match_slots, ext, strlen(ext)) : NULL;
+    if (match == NULL) { match = editor_syntax_lookup(matches, hdr->match_slots, base, strlen(base)); }
+    editor_syntax *syntax = match != NULL ? editor_syntax_get(match->value) : NULL;
+    if (syntax == NULL) { return; }
+
+    editor_cfg.buf->syntax = syntax;
+    uint64_t start = editor_prof.enabled ? prof_now() : 0;
+    for (size_t filerow = 0; filerow < editor_cfg.buf->num_erows; filerow++) {
+        if (editor_cfg.buf->erows[filerow].render == NULL) {
+            editor_update_row(&editor_cfg.buf->erows[filerow]);
+        } else {
+            editor_update_highlight(&editor_cfg.buf->erows[filerow]);
         }
     }
+    if (editor_prof.enabled) { editor_prof.highlight_ns += prof_now() - start; }
 }
 
-unsigned editor_row_cx_to_rx(editor_row_t *erow, unsigned cx) {
-    unsigned rx = 0;
-    for (unsigned j = 0; j < cx; j++) {
-        if (erow->chars[j] == '\t') { rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP); }
-        rx += 1;
+size_t editor_row_cx_to_rx(editor_row_t *erow, size_t cx) {
+    size_t rx = 0;
+    size_t j = 0;
+    while (j < cx) {
+        size_t ascii = erow->ascii ? cx - j : utf8_ascii_prefix(&erow->chars[j], cx - j);
+        for (size_t end = j + ascii; j < end; j++) {
+            if (erow->chars[j] == '\t') { rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP); }
+            rx += 1;
+        }
+
+        if (j < cx) {
+            uint32_t cp = 0;
+            j += utf8_decode(&erow->chars[j], erow->size - j, &cp);
+            rx += utf8_width(cp);
+        }
     }
 
     return rx;
 }
 
-unsigned editor_row_rx_to_cx(editor_row_t *erow, unsigned rx) {
-    unsigned cur_rx = 0;
-    unsigned cx = 0;
-    for (; cx < erow->size; cx++) {
+size_t editor_row_rx_to_cx(editor_row_t *erow, size_t rx) {
+    size_t cur_rx = 0;
+    size_t cx = 0;
+    while (cx < erow->size) {
+        unsigned len = 1;
         if (erow->chars[cx] == '\t') {
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+            cur_rx += KILO_TAB_STOP - (cur_rx % KILO_TAB_STOP);
+        } else if ((unsigned char)erow->chars[cx] < 0x80) {
+            cur_rx += 1;
+        } else {
+            uint32_t cp = 0;
+            len = utf8_decode(&erow->chars[cx], erow->size - cx, &cp);
+            cur_rx += utf8_width(cp);
         }
 
-        cur_rx += 1;
         if (cur_rx > rx) { return cx; }
+        cx += len;
+    }
+
+    return cx;
+}
+
+/* Display column of a byte offset into render, where tabs are already expanded */
+size_t editor_row_render_to_rx(editor_row_t *erow, size_t offset) {
+    if (erow->ascii) { return offset; }
+    size_t rx = 0;
+    size_t j = 0;
+    while (j < offset) {
+        size_t ascii = utf8_ascii_prefix(&erow->render[j], offset - j);
+        j += ascii;
+        rx += ascii;
+        if (j < offset) {
+            uint32_t cp = 0;
+            j += utf8_decode(&erow->render[j], erow->rsize - j, &cp);
+            rx += utf8_width(cp);
+        }
+    }
+
+    return rx;
+}
+
+/* Byte offset of the code point after the one at cx, skipping combining marks so
+ * the cursor never rests inside a character */
+size_t editor_row_next_cx(editor_row_t *erow, size_t cx) {
+    uint32_t cp = 0;
+    cx += utf8_decode(&erow->chars[cx], erow->size - cx, &cp);
+    while (cx < erow->size && (unsigned char)erow->chars[cx] >= 0x80) {
+        unsigned len = utf8_decode(&erow->chars[cx], erow->size - cx, &cp);
+        if (utf8_width(cp) != 0) { break; }
+        cx += len;
+    }
+
+    return cx;
+}
+
+/* Byte offset of the start of the code point before cx */
+size_t editor_row_prev_cp(editor_row_t *erow, size_t cx) {
+    size_t start = cx - 1;
+    while (start > 0 && cx - start < 4 && utf8_is_continuation(erow->chars[start])) { start -= 1; }
+    uint32_t cp = 0;
+    return start + utf8_decode(&erow->chars[start], erow->size - start, &cp) == cx ? start : cx - 1;
+}
+
+size_t editor_row_prev_cx(editor_row_t *erow, size_t cx) {
+    cx = editor_row_prev_cp(erow, cx);
+    while (cx > 0 && (unsigned char)erow->chars[cx] >= 0x80) {
+        uint32_t cp = 0;
+        utf8_decode(&erow->chars[cx], erow->size - cx, &cp);
+        if (utf8_width(cp) != 0) { break; }
+        cx = editor_row_prev_cp(erow, cx);
     }
 
     return cx;
 }
 
 void editor_update_row(editor_row_t *erow) {
-    unsigned tabs = 0;
-    for (unsigned j = 0; j < erow->size; j++) {
+    size_t tabs = 0;
+    for (size_t j = 0; j < erow->size; j++) {
         if (erow->chars[j] == '\t') { tabs += 1; }
     }
 
-    free(erow->render);
-    erow->render = (char *)calloc(erow->size + tabs * (KILO_TAB_STOP - 1) + 1, sizeof(char));
-    unsigned idx = 0;
-    for (unsigned j = 0; j < erow->size; j++) {
+    erow->render = (char *)editor_pool_realloc(erow->render, erow->size + tabs * (KILO_TAB_STOP - 1) + 1);
+    size_t idx = 0;
+    for (size_t j = 0; j < erow->size; j++) {
         if (erow->chars[j] == '\t') {
             erow->render[idx++] = ' ';
             while (idx % KILO_TAB_STOP != 0) { erow->render[idx++] = ' '; }
@@ -386,314 +1689,1617 @@ void editor_update_row(editor_row_t *erow) {
 
     erow->render[idx] = '\0';
     erow->rsize = idx;
+    erow->ascii = utf8_ascii_prefix(erow->chars, erow->size) == erow->size;
 
+    uint64_t start = editor_prof.enabled ? prof_now() : 0;
     editor_update_highlight(erow);
+    if (editor_prof.enabled) { editor_prof.highlight_ns += prof_now() - start; }
+}
+
+/* Rows loaded from disk are rendered lazily, the first time they are needed */
+void editor_row_prepare(editor_row_t *erow) {
+    if (erow->render == NULL) { editor_update_row(erow); }
+}
+
+void abuf_append_varint(abuf *ab, uint64_t value) {
+    char buf[10];
+    unsigned len = 0;
+    do {
+        buf[len] = (value & 0x7f) | (value >= 0x80 ? 0x80 : 0);
+        value >>= 7;
+        len += 1;
+    } while (value != 0);
+    abuf_append(ab, buf, len);
 }
 
-void editor_insert_row(unsigned at, char *str, size_t len) {
-    if (at > editor_cfg.num_erows) { return; }
-    editor_cfg.erows = (editor_row_t *)realloc( editor_cfg.erows, sizeof(editor_row_t) * (editor_cfg.num_erows + 1));
-    memmove(&editor_cfg.erows[at + 1], &editor_cfg.erows[at], sizeof(editor_row_t) * (editor_cfg.num_erows - at));
+char *editor_journal_path(const char *filename) {
+    const char *slash = strrchr(filename, '/');
+    int dir_len = slash != NULL ? slash - filename + 1 : 0;
+    size_t len = strlen(filename) + sizeof(".") + sizeof(".kswp");
+    char *path = malloc(len);
+    snprintf(path, len, "%.*s.%s.kswp", dir_len, filename, &filename[dir_len]);
+    return path;
+}
+
+void editor_journal_header(const char *filename, editor_journal_header_t *hdr) {
+    struct stat st;
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, KILO_JOURNAL_MAGIC, sizeof(hdr->magic));
+    hdr->pid = getpid();
+    if (stat(filename, &st) == -1) { return; }
+    hdr->size = st.st_size;
+    hdr->mtime_sec = st.st_mtim.tv_sec;
+    hdr->mtime_nsec = st.st_mtim.tv_nsec;
+    hdr->inode = st.st_ino;
+}
+
+void editor_journal_create() {
+    editor_journal_header_t hdr;
+    editor_journal_header(editor_cfg.buf->filename, &hdr);
+    editor_cfg.buf->journal.path = editor_journal_path(editor_cfg.buf->filename);
+    editor_cfg.buf->journal.fd = open(editor_cfg.buf->journal.path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (editor_cfg.buf->journal.fd == -1 || write(editor_cfg.buf->journal.fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        if (editor_cfg.buf->journal.fd != -1) { close(editor_cfg.buf->journal.fd); }
+        editor_cfg.buf->journal.fd = -1;
+        editor_cfg.buf->journal.failed = true;
+        free(editor_cfg.buf->journal.path);
+        editor_cfg.buf->journal.path = NULL;
+    }
+}
+
+/* Edits are appended to the journal as an op byte followed by varint row, column and
+ * payload length and the payload. They are buffered and made durable on a timer. */
+void editor_journal_record(enum editor_edit_op op, size_t row, size_t col, const char *data, size_t len) {
+    if (editor_cfg.buf->filename == NULL || editor_cfg.buf->journal.failed) { return; }
+    if (editor_cfg.buf->journal.fd == -1) {
+        editor_journal_create();
+        if (editor_cfg.buf->journal.fd == -1) { return; }
+    }
+
+    char op_byte = op;
+    abuf *pending = &editor_cfg.buf->journal.pending;
+    abuf_append(pending, &op_byte, 1);
+    abuf_append_varint(pending, row);
+    abuf_append_varint(pending, col);
+    abuf_append_varint(pending, len);
+    if (len > 0) { abuf_append(pending, data, len); }
+    if (editor_cfg.buf->journal.flush_at == 0) {
+        editor_cfg.buf->journal.flush_at = prof_now() + KILO_JOURNAL_FLUSH_NS;
+    }
+}
+
+/* Writes all of buf, which takes several calls once it is past the ~2GB that a single
+ * write(2) moves */
+bool editor_write_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t written = write(fd, &buf[off], len - off);
+        if (written == -1 && errno == EINTR) { continue; }
+        if (written <= 0) { return false; }
+        off += written;
+    }
+
+    return true;
+}
+
+void editor_journal_flush() {
+    abuf *pending = &editor_cfg.buf->journal.pending;
+    editor_cfg.buf->journal.flush_at = 0;
+    if (editor_cfg.buf->journal.fd == -1 || pending->len == 0) { return; }
+    editor_write_all(editor_cfg.buf->journal.fd, pending->data, pending->len);
+    fdatasync(editor_cfg.buf->journal.fd);
+    pending->len = 0;
+}
+
+void editor_journal_tick() {
+    if (editor_cfg.buf->journal.flush_at != 0 && prof_now() >= editor_cfg.buf->journal.flush_at) {
+        editor_journal_flush();
+    }
+}
+
+int editor_journal_timeout_ms(int timeout) {
+    if (editor_cfg.buf->journal.flush_at == 0) { return timeout; }
+    uint64_t now = prof_now();
+    int due = now >= editor_cfg.buf->journal.flush_at ? 0 : (editor_cfg.buf->journal.flush_at - now + 999999) / 1000000;
+    return (timeout == -1 || due < timeout) ? due : timeout;
+}
+
+/* Called once the file on disk holds everything, after a save or on a deliberate quit */
+void editor_journal_discard() {
+    if (editor_cfg.buf->journal.fd != -1) {
+        close(editor_cfg.buf->journal.fd);
+        unlink(editor_cfg.buf->journal.path);
+    }
+
+    free(editor_cfg.buf->journal.path);
+    editor_cfg.buf->journal.path = NULL;
+    editor_cfg.buf->journal.fd = -1;
+    editor_cfg.buf->journal.pending.len = 0;
+    editor_cfg.buf->journal.flush_at = 0;
+}
+
+void undo_text_end(size_t row, size_t col, const char *text, size_t len, size_t *end_row, size_t *end_col) {
+    const char *last = NULL;
+    for (const char *p = text; (p = memchr(p, '\n', &text[len] - p)) != NULL; p++) {
+        row += 1;
+        last = p;
+    }
+
+    *end_row = row;
+    *end_col = last != NULL ? (size_t)(&text[len] - last - 1) : col + len;
+}
+
+size_t editor_undo_usage() {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    return undo->arena_len - undo->arena_start + undo->total * sizeof(undo_record_t);
+}
+
+/* Drops the oldest history, a whole group at a time, until the log fits its cap again.
+ * The open group is still growing and is only weighed once it closes. */
+void editor_undo_trim() {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    size_t drop = 0;
+    size_t usage = editor_undo_usage();
+    while (drop < undo->total && usage > undo->limit &&
+           !(undo->group_open && undo->records[drop].group == undo->group)) {
+        usage -= undo->records[drop].len + sizeof(undo_record_t);
+        drop += 1;
+    }
+
+    while (drop > 0 && drop < undo->total && undo->records[drop].group == undo->records[drop - 1].group) { drop += 1; }
+
+    if (drop == 0) { return; }
+    undo->arena_start = drop < undo->total ? undo->records[drop].offset : undo->arena_len;
+    memmove(undo->records, &undo->records[drop], (undo->total - drop) * sizeof(undo_record_t));
+    undo->total -= drop;
+    undo->count = undo->count > drop ? undo->count - drop : 0;
+
+    if (undo->arena_start > undo->arena_len / 2) {
+        memmove(undo->arena, &undo->arena[undo->arena_start], undo->arena_len - undo->arena_start);
+        for (size_t j = 0; j < undo->total; j++) { undo->records[j].offset -= undo->arena_start; }
+        undo->arena_len -= undo->arena_start;
+        undo->arena_start = 0;
+    }
+}
+
+void editor_undo_arena_append(const char *data, size_t len) {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    if (undo->arena_len + len > undo->arena_cap) {
+        size_t cap = undo->arena_cap != 0 ? undo->arena_cap * 2 : 4096;
+        while (cap < undo->arena_len + len) { cap *= 2; }
+        undo->arena = realloc(undo->arena, cap);
+        undo->arena_cap = cap;
+    }
+
+    memcpy(&undo->arena[undo->arena_len], data, len);
+    undo->arena_len += len;
+}
+
+/* Appends a record, or extends the previous one when this insert continues it */
+void editor_undo_push(enum editor_undo_type type, size_t row, size_t col,
+                      const char *data, size_t len, const char *data2, size_t len2) {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    if (undo->count < undo->total) {
+        undo->total = undo->count;
+        undo->arena_len = undo->count > 0
+            ? undo->records[undo->count - 1].offset + undo->records[undo->count - 1].len
+            : undo->arena_start;
+    }
+
+    if (!undo->group_open) {
+        undo->group += 1;
+        undo->group_open = true;
+    }
+
+    undo_record_t *last = undo->count > 0 ? &undo->records[undo->count - 1] : NULL;
+    if (type == UNDO_INSERT && last != NULL && last->type == UNDO_INSERT && last->group == undo->group &&
+        last->end_row == row && last->end_col == col) {
+        editor_undo_arena_append(data, len);
+        if (len2 > 0) { editor_undo_arena_append(data2, len2); }
+        undo_text_end(last->row, last->col, &undo->arena[last->offset], last->len + len + len2,
+                      &last->end_row, &last->end_col);
+        last->len += len + len2;
+        editor_undo_trim();
+        return;
+    }
+
+    if (undo->total == undo->cap) {
+        undo->cap = undo->cap != 0 ? undo->cap * 2 : 256;
+        undo->records = realloc(undo->records, undo->cap * sizeof(undo_record_t));
+    }
+
+    undo_record_t *rec = &undo->records[undo->total];
+    rec->type = type;
+    rec->row = row;
+    rec->col = col;
+    rec->offset = undo->arena_len;
+    rec->len = len + len2;
+    rec->group = undo->group;
+    editor_undo_arena_append(data, len);
+    if (len2 > 0) { editor_undo_arena_append(data2, len2); }
+    undo_text_end(row, col, &undo->arena[rec->offset], rec->len, &rec->end_row, &rec->end_col);
+    undo->total += 1;
+    undo->count = undo->total;
+    editor_undo_trim();
+}
+
+void editor_undo_boundary() {
+    if (!editor_cfg.buf->undo.group_open) { return; }
+    editor_cfg.buf->undo.group_open = false;
+    editor_undo_trim();
+}
+
+/* Forgets all history, for when the buffer is replaced underneath it */
+void editor_undo_free() {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    free(undo->records);
+    free(undo->arena);
+    undo->records = NULL;
+    undo->arena = NULL;
+    undo->count = 0;
+    undo->total = 0;
+    undo->cap = 0;
+    undo->arena_start = 0;
+    undo->arena_len = 0;
+    undo->arena_cap = 0;
+    undo->group_open = false;
+    undo->applying = false;
+}
+
+/* Translates a row primitive, called before it runs, into a text record */
+void editor_undo_record(enum editor_edit_op op, size_t row, size_t col, const char *data, size_t len) {
+    if (editor_cfg.buf->undo.applying) { return; }
+    size_t num = editor_cfg.buf->num_erows;
+    editor_row_t *erows = editor_cfg.buf->erows;
+    switch (op) {
+        case EDIT_INSERT_CHAR:
+        case EDIT_INSERT_TEXT: editor_undo_push(UNDO_INSERT, row, col, data, len, NULL, 0); break;
+        case EDIT_DELETE_CHAR:
+        case EDIT_DELETE_TEXT: editor_undo_push(UNDO_DELETE, row, col, data, len, NULL, 0); break;
+        case EDIT_APPEND_STRING: editor_undo_push(UNDO_INSERT, row, erows[row].size, data, len, NULL, 0); break;
+        case EDIT_SPLIT_ROW: editor_undo_push(UNDO_INSERT, row, col, "\n", 1, NULL, 0); break;
+        case EDIT_JOIN_ROW: editor_undo_push(UNDO_DELETE, row - 1, erows[row - 1].size, "\n", 1, NULL, 0); break;
+        case EDIT_INSERT_ROW:
+            if (row < num) {
+                editor_undo_push(UNDO_INSERT, row, 0, data, len, "\n", 1);
+            } else if (num > 0) {
+                editor_undo_push(UNDO_INSERT, num - 1, erows[num - 1].size, "\n", 1, data, len);
+            } else {
+                editor_undo_push(UNDO_INSERT_ROW, 0, 0, data, len, NULL, 0);
+            }
+            break;
+        case EDIT_DELETE_ROW:
+            if (row + 1 < num) {
+                editor_undo_push(UNDO_DELETE, row, 0, erows[row].chars, erows[row].size, "\n", 1);
+            } else if (num > 1) {
+                editor_undo_push(UNDO_DELETE, row - 1, erows[row - 1].size, "\n", 1,
+                                 erows[row].chars, erows[row].size);
+            } else {
+                editor_undo_push(UNDO_DELETE_ROW, 0, 0, erows[row].chars, erows[row].size, NULL, 0);
+            }
+            break;
+    }
+}
+
+void editor_log_edit(enum editor_edit_op op, size_t row, size_t col, const char *data, size_t len) {
+    if (editor_cfg.edit_nesting > 0) { return; }
+    editor_journal_record(op, row, col, data, len);
+    editor_undo_record(op, row, col, data, len);
+}
+
+void editor_reserve_rows(size_t count) {
+    if (count <= editor_cfg.buf->erows_cap) { return; }
+    size_t cap = editor_cfg.buf->erows_cap != 0 ? editor_cfg.buf->erows_cap * 2 : 64;
+    while (cap < count) { cap *= 2; }
+    editor_row_t *erows = (editor_row_t *)realloc(editor_cfg.buf->erows, sizeof(editor_row_t) * cap);
+    if (erows == NULL) { die("editor_reserve_rows :: realloc"); }
+    editor_cfg.buf->erows = erows;
+    editor_cfg.buf->erows_cap = cap;
+}
+
+void editor_insert_row(size_t at, char *str, size_t len) {
+    if (at > editor_cfg.buf->num_erows) { return; }
+    editor_log_edit(EDIT_INSERT_ROW, at, 0, str, len);
+    editor_reserve_rows(editor_cfg.buf->num_erows + 1);
+    memmove(&editor_cfg.buf->erows[at + 1], &editor_cfg.buf->erows[at], sizeof(editor_row_t) * (editor_cfg.buf->num_erows - at));
+
+    for (size_t j = at + 1; j <= editor_cfg.buf->num_erows; j++) {
+        editor_cfg.buf->erows[j].idx += 1;
+    }
+
+    editor_cfg.buf->erows[at].idx = at;
+    editor_cfg.buf->erows[at].size = len;
+    editor_cfg.buf->erows[at].chars = (char *)editor_pool_alloc(len + 1);
+    memcpy(editor_cfg.buf->erows[at].chars, str, len);
+    editor_cfg.buf->erows[at].chars[len] = '\0';
+    editor_cfg.buf->erows[at].rsize = 0;
+    editor_cfg.buf->erows[at].render = NULL;
+    editor_cfg.buf->erows[at].highlight = NULL;
+    editor_cfg.buf->erows[at].hl_open_comment = false;
+    editor_update_row(&editor_cfg.buf->erows[at]);
+    editor_cfg.buf->num_erows += 1;
+    editor_cfg.buf->dirty = true;
+}
+
+void editor_free_row(editor_row_t *erow) {
+    editor_pool_free(erow->highlight);
+    editor_pool_free(erow->render);
+    editor_pool_free(erow->chars);
+}
+
+void editor_free_rows() {
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) { editor_free_row(&editor_cfg.buf->erows[j]); }
+    free(editor_cfg.buf->erows);
+    editor_cfg.buf->erows = NULL;
+    editor_cfg.buf->num_erows = 0;
+    editor_cfg.buf->erows_cap = 0;
+}
+
+/* Appends text read from disk as rows at the end of the buffer without marking it
+ * dirty. The row array grows once per batch and only the new rows are rendered. When
+ * the previous batch ended without a newline its last row is continued first. */
+void editor_append_rows(const char *buf, size_t len, bool continue_last) {
+    size_t pos = 0;
+    if (continue_last && editor_cfg.buf->num_erows > 0) {
+        const char *nl = memchr(buf, '\n', len);
+        size_t seg = nl != NULL ? (size_t)(nl - buf) : len;
+        size_t keep = seg;
+        while (keep > 0 && buf[keep - 1] == '\r') { keep -= 1; }
+        editor_row_t *erow = &editor_cfg.buf->erows[editor_cfg.buf->num_erows - 1];
+        erow->chars = (char *)editor_pool_realloc(erow->chars, erow->size + keep + 1);
+        memcpy(&erow->chars[erow->size], buf, keep);
+        erow->size += keep;
+        erow->chars[erow->size] = '\0';
+        editor_update_row(erow);
+        pos = nl != NULL ? seg + 1 : len;
+    }
+
+    size_t count = 0;
+    for (const char *p = &buf[pos]; (p = memchr(p, '\n', &buf[len] - p)) != NULL; p++) { count += 1; }
+    if (pos < len && buf[len - 1] != '\n') { count += 1; }
+    editor_reserve_rows(editor_cfg.buf->num_erows + count);
+
+    while (pos < len) {
+        const char *nl = memchr(&buf[pos], '\n', len - pos);
+        size_t end = nl != NULL ? (size_t)(nl - buf) : len;
+        size_t line_len = end - pos;
+        while (line_len > 0 && buf[pos + line_len - 1] == '\r') { line_len -= 1; }
+
+        editor_row_t *erow = &editor_cfg.buf->erows[editor_cfg.buf->num_erows];
+        erow->idx = editor_cfg.buf->num_erows;
+        erow->size = line_len;
+        erow->chars = (char *)editor_pool_alloc(line_len + 1);
+        memcpy(erow->chars, &buf[pos], line_len);
+        erow->chars[line_len] = '\0';
+        erow->rsize = 0;
+        erow->render = NULL;
+        erow->highlight = NULL;
+        erow->hl_open_comment = false;
+        editor_update_row(erow);
+        editor_cfg.buf->num_erows += 1;
+        pos = end + 1;
+    }
+}
+
+void editor_del_row(size_t at) {
+    if (at >= editor_cfg.buf->num_erows) { return; }
+    editor_log_edit(EDIT_DELETE_ROW, at, 0, NULL, 0);
+    editor_free_row(&editor_cfg.buf->erows[at]);
+    memmove(&editor_cfg.buf->erows[at], &editor_cfg.buf->erows[at + 1], sizeof(editor_row_t) * (editor_cfg.buf->num_erows - at - 1));
+
+    for (size_t j = at; j < editor_cfg.buf->num_erows - 1; j++) {
+        editor_cfg.buf->erows[j].idx -= 1;
+    }
+
+    editor_cfg.buf->num_erows -= 1;
+    editor_cfg.buf->dirty = true;
+}
+
+void editor_row_insert_char(editor_row_t *erow, size_t at, unsigned chr) {
+    if (at > erow->size) { at = erow->size; }
+    char byte = chr;
+    editor_log_edit(EDIT_INSERT_CHAR, erow->idx, at, &byte, 1);
+    erow->chars = (char *)editor_pool_realloc(erow->chars, erow->size + 2);
+    memmove(&erow->chars[at + 1], &erow->chars[at], erow->size - at + 1);
+    erow->size += 1;
+    erow->chars[at] = chr;
+    editor_update_row(erow);
+    editor_cfg.buf->dirty = true;
+}
+
+void editor_row_append_string(editor_row_t *erow, char *str, size_t len) {
+    editor_log_edit(EDIT_APPEND_STRING, erow->idx, 0, str, len);
+    erow->chars = (char *)editor_pool_realloc(erow->chars, erow->size + len + 1);
+    memcpy(&erow->chars[erow->size], str, len);
+    erow->size += len;
+    erow->chars[erow->size] = '\0';
+    editor_update_row(erow);
+    editor_cfg.buf->dirty = true;
+}
+
+void editor_row_del_char(editor_row_t *erow, size_t at) {
+    if (at >= erow->size) { return; }
+    editor_log_edit(EDIT_DELETE_CHAR, erow->idx, at, &erow->chars[at], 1);
+    memmove(&erow->chars[at], &erow->chars[at + 1], erow->size - at);
+    erow->size -= 1;
+    editor_update_row(erow);
+    editor_cfg.buf->dirty = true;
+}
+
+void editor_split_row(size_t at, size_t col) {
+    if (at >= editor_cfg.buf->num_erows || col > editor_cfg.buf->erows[at].size) { return; }
+    editor_log_edit(EDIT_SPLIT_ROW, at, col, NULL, 0);
+    editor_cfg.edit_nesting += 1;
+    editor_row_t *erow = &editor_cfg.buf->erows[at];
+    editor_insert_row(at + 1, &erow->chars[col], erow->size - col);
+    erow = &editor_cfg.buf->erows[at];
+    erow->size = col;
+    erow->chars[erow->size] = '\0';
+    editor_update_row(erow);
+    editor_cfg.edit_nesting -= 1;
+}
+
+void editor_join_row(size_t at) {
+    if (at == 0 || at >= editor_cfg.buf->num_erows) { return; }
+    editor_log_edit(EDIT_JOIN_ROW, at, 0, NULL, 0);
+    editor_cfg.edit_nesting += 1;
+    editor_row_t *erow = &editor_cfg.buf->erows[at];
+    editor_row_append_string(&editor_cfg.buf->erows[at - 1], erow->chars, erow->size);
+    editor_del_row(at);
+    editor_cfg.edit_nesting -= 1;
+}
+
+/* After a splice, carries the comment state on from the row that now ends the
+ * spliced text. The rows after it were computed against was_open, the end state of
+ * the row that used to precede them, so this stops once the two agree again. */
+void editor_comment_propagate(size_t last, bool was_open) {
+    for (size_t j = last + 1; j < editor_cfg.buf->num_erows; j++) {
+        if (editor_cfg.buf->erows[j - 1].hl_open_comment == was_open) { break; }
+        editor_row_t *next = &editor_cfg.buf->erows[j];
+        was_open = next->hl_open_comment;
+        if (next->render != NULL) {
+            editor_update_highlight(next);
+            break;
+        }
+
+        next->hl_open_comment = editor_comment_state(next->chars, next->size, editor_cfg.buf->erows[j - 1].hl_open_comment);
+    }
+}
+
+/* Inserts text that may span several lines at (at, col) with a single move of the
+ * row array, however many lines it holds */
+void editor_insert_text(size_t at, size_t col, const char *str, size_t len) {
+    if (at >= editor_cfg.buf->num_erows || col > editor_cfg.buf->erows[at].size || len == 0) { return; }
+    editor_log_edit(EDIT_INSERT_TEXT, at, col, str, len);
+    size_t lines = 0;
+    for (const char *p = str; (p = memchr(p, '\n', &str[len] - p)) != NULL; p++) { lines += 1; }
+
+    editor_row_t *erow = &editor_cfg.buf->erows[at];
+    if (lines == 0) {
+        erow->chars = (char *)editor_pool_realloc(erow->chars, erow->size + len + 1);
+        memmove(&erow->chars[col + len], &erow->chars[col], erow->size - col + 1);
+        memcpy(&erow->chars[col], str, len);
+        erow->size += len;
+        editor_update_row(erow);
+        editor_cfg.buf->dirty = true;
+        return;
+    }
+
+    editor_reserve_rows(editor_cfg.buf->num_erows + lines);
+    erow = &editor_cfg.buf->erows[at];
+    memmove(&editor_cfg.buf->erows[at + 1 + lines], &editor_cfg.buf->erows[at + 1],
+            sizeof(editor_row_t) * (editor_cfg.buf->num_erows - at - 1));
+    for (size_t j = at + 1 + lines; j < editor_cfg.buf->num_erows + lines; j++) { editor_cfg.buf->erows[j].idx += lines; }
+
+    bool was_open = erow->hl_open_comment;
+    size_t tail_len = erow->size - col;
+    char *tail = erow->chars;
+    const char *seg = str;
+    const char *nl = memchr(seg, '\n', len);
+    erow->chars = (char *)editor_pool_alloc(col + (nl - seg) + 1);
+    memcpy(erow->chars, tail, col);
+    memcpy(&erow->chars[col], seg, nl - seg);
+    erow->size = col + (nl - seg);
+    erow->chars[erow->size] = '\0';
+
+    for (size_t j = 1; j <= lines; j++) {
+        seg = nl + 1;
+        nl = j < lines ? memchr(seg, '\n', &str[len] - seg) : &str[len];
+        size_t seg_len = nl - seg;
+        size_t extra = j == lines ? tail_len : 0;
+        editor_row_t *row = &editor_cfg.buf->erows[at + j];
+        row->idx = at + j;
+        row->size = seg_len + extra;
+        row->chars = (char *)editor_pool_alloc(row->size + 1);
+        memcpy(row->chars, seg, seg_len);
+        memcpy(&row->chars[seg_len], &tail[col], extra);
+        row->chars[row->size] = '\0';
+        row->rsize = 0;
+        row->render = NULL;
+        row->highlight = NULL;
+        row->hl_open_comment = false;
+    }
+
+    editor_pool_free(tail);
+    editor_cfg.buf->num_erows += lines;
+    for (size_t j = at; j <= at + lines; j++) { editor_update_row(&editor_cfg.buf->erows[j]); }
+    editor_comment_propagate(at + lines, was_open);
+    editor_cfg.buf->dirty = true;
+}
+
+/* Deletes the len bytes of text starting at (at, col), which may span lines */
+void editor_delete_text(size_t at, size_t col, const char *text, size_t len) {
+    size_t end_at = 0;
+    size_t end_col = 0;
+    undo_text_end(at, col, text, len, &end_at, &end_col);
+    if (end_at >= editor_cfg.buf->num_erows || col > editor_cfg.buf->erows[at].size ||
+        end_col > editor_cfg.buf->erows[end_at].size || len == 0) {
+        return;
+    }
+
+    editor_log_edit(EDIT_DELETE_TEXT, at, col, text, len);
+    editor_row_t *erow = &editor_cfg.buf->erows[at];
+    editor_row_t *last = &editor_cfg.buf->erows[end_at];
+    size_t keep = last->size - end_col;
+    if (end_at == at) {
+        memmove(&erow->chars[col], &erow->chars[end_col], keep + 1);
+        erow->size = col + keep;
+        editor_update_row(erow);
+        editor_cfg.buf->dirty = true;
+        return;
+    }
+
+    bool was_open = last->hl_open_comment;
+    erow->chars = (char *)editor_pool_realloc(erow->chars, col + keep + 1);
+    memcpy(&erow->chars[col], &last->chars[end_col], keep);
+    erow->size = col + keep;
+    erow->chars[erow->size] = '\0';
+
+    size_t lines = end_at - at;
+    for (size_t j = at + 1; j <= end_at; j++) { editor_free_row(&editor_cfg.buf->erows[j]); }
+    memmove(&editor_cfg.buf->erows[at + 1], &editor_cfg.buf->erows[end_at + 1],
+            sizeof(editor_row_t) * (editor_cfg.buf->num_erows - end_at - 1));
+    editor_cfg.buf->num_erows -= lines;
+    for (size_t j = at + 1; j < editor_cfg.buf->num_erows; j++) { editor_cfg.buf->erows[j].idx -= lines; }
+    editor_update_row(erow);
+    editor_comment_propagate(at, was_open);
+    editor_cfg.buf->dirty = true;
+}
+
+void editor_undo_apply(undo_record_t *rec, bool redo) {
+    char *payload = &editor_cfg.buf->undo.arena[rec->offset];
+    bool insert = (rec->type == UNDO_INSERT || rec->type == UNDO_INSERT_ROW) == redo;
+    if (rec->type == UNDO_INSERT_ROW || rec->type == UNDO_DELETE_ROW) {
+        if (insert) {
+            editor_insert_row(0, payload, rec->len);
+        } else {
+            editor_del_row(0);
+        }
+    } else if (insert) {
+        editor_insert_text(rec->row, rec->col, payload, rec->len);
+    } else {
+        editor_delete_text(rec->row, rec->col, payload, rec->len);
+    }
+
+    bool at_end = redo && insert;
+    editor_cfg.buf->cy = at_end ? rec->end_row : rec->row;
+    editor_cfg.buf->cx = at_end ? rec->end_col : rec->col;
+}
+
+/* Draws ASCII text a byte per column, in runs of the same highlight */
+void editor_draw_ascii(abuf *ab, const char *chr, const unsigned char *hl, long len) {
+    long i = 0;
+    while (i < len) {
+        if (iscntrl((unsigned char)chr[i])) {
+            char sym = (chr[i] <= 26) ? '@' + chr[i] : '?';
+            abuf_sgr(ab, ab->sgr_colour, true);
+            abuf_append(ab, &sym, 1);
+            i += 1;
+            continue;
+        }
+
+        long run = i + 1;
+        while (run < len && hl[run] == hl[i] && !iscntrl((unsigned char)chr[run])) { run += 1; }
+        abuf_sgr(ab, editor_highlight_to_colour(hl[i]), false);
+        abuf_append(ab, &chr[i], run - i);
+        i = run;
+    }
+}
+
+/* Draws a row holding multibyte text from display column col_offset and returns the
+ * columns used. ASCII stretches go through editor_draw_ascii, a wide character cut by
+ * either edge of the screen is shown as spaces and malformed bytes as a '?' symbol. */
+long editor_draw_row_utf8(abuf *ab, editor_row_t *erow) {
+    long cols = 0;
+    size_t rx = 0;
+    size_t i = 0;
+    while (i < erow->rsize && cols < editor_cfg.screen_cols) {
+        size_t ascii = utf8_ascii_prefix(&erow->render[i], erow->rsize - i);
+        if (ascii > 0) {
+            size_t skip = rx < editor_cfg.buf->col_offset ? editor_cfg.buf->col_offset - rx : 0;
+            if (skip > ascii) { skip = ascii; }
+            long n = ascii - skip;
+            if (n > editor_cfg.screen_cols - cols) { n = editor_cfg.screen_cols - cols; }
+            editor_draw_ascii(ab, &erow->render[i + skip], &erow->highlight[i + skip], n);
+            i += skip + n;
+            rx += skip + n;
+            cols += n;
+            continue;
+        }
+
+        uint32_t cp = 0;
+        unsigned n = utf8_decode(&erow->render[i], erow->rsize - i, &cp);
+        unsigned width = utf8_width(cp);
+        if (rx < editor_cfg.buf->col_offset || cols + width > editor_cfg.screen_cols) {
+            long visible = rx < editor_cfg.buf->col_offset
+                ? (long)(rx + width > editor_cfg.buf->col_offset ? rx + width - editor_cfg.buf->col_offset : 0)
+                : editor_cfg.screen_cols - cols;
+            abuf_sgr(ab, editor_highlight_to_colour(erow->highlight[i]), false);
+            for (long k = 0; k < visible; k++) { abuf_append(ab, " ", 1); }
+            cols += visible;
+        } else if (cp == UTF8_INVALID || cp < 0xa0) {
+            abuf_sgr(ab, ab->sgr_colour, true);
+            abuf_append(ab, "?", 1);
+            cols += 1;
+        } else {
+            abuf_sgr(ab, editor_highlight_to_colour(erow->highlight[i]), false);
+            abuf_append(ab, &erow->render[i], n);
+            cols += width;
+        }
+
+        i += n;
+        rx += width;
+    }
+
+    return cols;
+}
+
+void editor_draw_rows(abuf *ab) {
+    for (unsigned y = 0; y < editor_cfg.screen_rows; y++) {
+        size_t file_row = y + editor_cfg.buf->row_offset;
+        long len = 0;
+        if (file_row >= editor_cfg.buf->num_erows) {
+            abuf_sgr(ab, 39, false);
+            if (editor_cfg.buf->num_erows == 0 && y == editor_cfg.screen_rows / 3) {
+                char welcome[80] = {0};
+                unsigned welcome_len = snprintf( welcome, sizeof(welcome), "Kilo Editor -- version %s", KILO_VERSION);
+                if (welcome_len > editor_cfg.screen_cols) { welcome_len = editor_cfg.screen_cols; }
+                unsigned padding = (editor_cfg.screen_cols - welcome_len) / 2;
+                if (padding != 0) { abuf_append(ab, "~", 1); }
+                while (padding--) { abuf_append(ab, " ", 1); }
+                abuf_append(ab, welcome, welcome_len);
+
+            } else {
+                abuf_append(ab, "~", 1);
+            }
+        } else {
+            editor_row_prepare(&editor_cfg.buf->erows[file_row]);
+            len = (long)editor_cfg.buf->erows[file_row].rsize - (long)editor_cfg.buf->col_offset;
+            if (len < 0) { len = 0; }
+            if (len > editor_cfg.screen_cols) { len = editor_cfg.screen_cols; }
+            if (editor_cfg.buf->erows[file_row].ascii) {
+                editor_draw_ascii(ab, &editor_cfg.buf->erows[file_row].render[editor_cfg.buf->col_offset],
+                                  &editor_cfg.buf->erows[file_row].highlight[editor_cfg.buf->col_offset], len);
+            } else {
+                len = editor_draw_row_utf8(ab, &editor_cfg.buf->erows[file_row]);
+            }
+        }
+
+        /* A row that fills the screen overwrites everything, otherwise clear the tail */
+        if (len < editor_cfg.screen_cols) {
+            abuf_sgr(ab, ab->sgr_colour, false);
+            abuf_append(ab, "\x1b[K", 3);
+        }
+
+        abuf_append(ab, "\r\n", 2);
+    }
+}
+
+void editor_scroll() {
+    editor_cfg.buf->rx = 0;
+
+    if (editor_cfg.buf->cy < editor_cfg.buf->num_erows) {
+        editor_cfg.buf->rx = editor_row_cx_to_rx(&editor_cfg.buf->erows[editor_cfg.buf->cy], editor_cfg.buf->cx);
+    }
+
+    if (editor_cfg.buf->cy < editor_cfg.buf->row_offset) { editor_cfg.buf->row_offset = editor_cfg.buf->cy; }
+
+    if (editor_cfg.buf->cy >= editor_cfg.buf->row_offset + editor_cfg.screen_rows) {
+        editor_cfg.buf->row_offset = editor_cfg.buf->cy - editor_cfg.screen_rows + 1;
+    }
+
+    if (editor_cfg.buf->rx < editor_cfg.buf->col_offset) { editor_cfg.buf->col_offset = editor_cfg.buf->rx; }
+
+    if (editor_cfg.buf->rx >= editor_cfg.buf->col_offset + editor_cfg.screen_cols) {
+        editor_cfg.buf->col_offset = editor_cfg.buf->rx - editor_cfg.screen_cols + 1;
+    }
+}
+
+void editor_draw_statusbar(abuf *ab) {
+    abuf_sgr(ab, 39, true);
+    char status[80] = {0};
+    char rstatus[80] = {0};
+    unsigned len = 0;
+    if (editor_cfg.num_buffers > 1) {
+        char mem[16] = {0};
+        editor_format_bytes(mem, sizeof(mem), editor_buffer_memory(editor_cfg.buf));
+        len = snprintf(status, sizeof(status), "[%u/%u %s] ", editor_buffer_index() + 1, editor_cfg.num_buffers, mem);
+        if (len > sizeof(status) - 1) { len = sizeof(status) - 1; }
+    }
+    len += snprintf(&status[len], sizeof(status) - len, "%.20s - %zu lines %s",
+                    editor_cfg.buf->filename != NULL ? editor_cfg.buf->filename : "[No Name]",
+                    editor_cfg.buf->num_erows, editor_cfg.buf->dirty ? "(modified)" : "");
+    if (len > sizeof(status) - 1) { len = sizeof(status) - 1; }
+    unsigned rlen = 0;
+    if (editor_prof.enabled) {
+        prof_histogram_t *lat = &editor_prof.hist[PROF_LATENCY];
+        char p50[16] = {0};
+        char p99[16] = {0};
+        prof_format_ns(p50, sizeof(p50), prof_percentile(lat, 50.0));
+        prof_format_ns(p99, sizeof(p99), prof_percentile(lat, 99.0));
+        rlen = snprintf(rstatus, sizeof(rstatus), "p50 %s p99 %s %lluB | ", p50, p99,
+                        (unsigned long long)prof_percentile(&editor_prof.hist[PROF_FRAME_BYTES], 50.0));
+        if (rlen > sizeof(rstatus) - 1) { rlen = sizeof(rstatus) - 1; }
+    }
+    rlen += snprintf(&rstatus[rlen], sizeof(rstatus) - rlen, "%s | %zu/%zu",
+                 editor_cfg.buf->syntax != NULL ? editor_cfg.buf->syntax->filetype : "no ft",
+                 editor_cfg.buf->cy + 1, editor_cfg.buf->num_erows);
+    if (rlen > sizeof(rstatus) - 1) { rlen = sizeof(rstatus) - 1; }
+    if (len > editor_cfg.screen_cols) { len = editor_cfg.screen_cols; }
+    if (editor_prof.enabled && len + rlen > editor_cfg.screen_cols && rlen <= editor_cfg.screen_cols) {
+        len = editor_cfg.screen_cols - rlen;
+    }
+    abuf_append(ab, status, len);
+    while (len < editor_cfg.screen_cols) {
+        if (editor_cfg.screen_cols - len == rlen) {
+            abuf_append(ab, rstatus, rlen);
+            break;
+        } else {
+            abuf_append(ab, " ", 1);
+            len += 1;
+        }
+    }
+
+    abuf_sgr(ab, 39, false);
+    abuf_append(ab, "\r\n", 2);
+}
+
+void editor_draw_msg_bar(abuf *ab) {
+    abuf_append(ab, "\x1b[K", 3);
+    unsigned msg_len = strlen(editor_cfg.status_msg);
+    if (msg_len > editor_cfg.screen_cols) { msg_len = editor_cfg.screen_cols; }
+
+    if (msg_len > 0 && time(NULL) - editor_cfg.status_msg_time < 5) {
+        abuf_append(ab, editor_cfg.status_msg, msg_len);
+    }
+}
+
+void editor_prof_frame(uint64_t write_start, size_t bytes) {
+    uint64_t end = prof_now();
+    prof_record(PROF_WRITE, end - write_start);
+    prof_record(PROF_FRAME_BYTES, bytes);
+    if (editor_prof.highlight_ns != 0) {
+        prof_record(PROF_HIGHLIGHT, editor_prof.highlight_ns);
+        editor_prof.highlight_ns = 0;
+    }
+
+    if (editor_prof.key_time != 0) {
+        prof_record(PROF_LATENCY, end - editor_prof.key_time);
+        editor_prof.key_time = 0;
+    }
+
+    editor_prof.frames += 1;
+}
+
+/* Renders are coalesced: input is drained first and a frame is drawn at most once per
+ * interval, which follows the measured cost of writing a frame to the terminal */
+typedef struct {
+    bool pending;
+    uint64_t next_frame;
+    uint64_t interval_ns;
+    double ns_per_byte;
+} editor_pacer_t;
+
+static editor_pacer_t editor_pacer = {true, 0, KILO_FRAME_MIN_NS, 0.0};
+
+void editor_pacer_update(uint64_t write_ns, size_t bytes) {
+    if (bytes == 0) { return; }
+    double sample = (double)write_ns / bytes;
+    editor_pacer.ns_per_byte = editor_pacer.ns_per_byte == 0.0
+        ? sample : 0.8 * editor_pacer.ns_per_byte + 0.2 * sample;
+
+    /* Leave the terminal twice the time it needs to take a frame of this size */
+    uint64_t interval = (uint64_t)(2.0 * editor_pacer.ns_per_byte * bytes);
+    if (interval < KILO_FRAME_MIN_NS) { interval = KILO_FRAME_MIN_NS; }
+    if (interval > KILO_FRAME_MAX_NS) { interval = KILO_FRAME_MAX_NS; }
+    editor_pacer.interval_ns = interval;
+}
+
+void editor_refresh_screen() {
+    ALLOC_ENTER(ALLOC_OP_RENDER);
+    editor_scroll();
+    abuf ab = ABUF_INIT;
+    if (editor_cfg.sync_output) { abuf_append(&ab, "\x1b[?2026h", 8); }
+    abuf_append(&ab, "\x1b[?25l", 6);
+    abuf_append(&ab, "\x1b[H", 3);
+    uint64_t start = editor_prof.enabled ? prof_now() : 0;
+    editor_draw_rows(&ab);
+    if (editor_prof.enabled) { prof_record(PROF_DRAW_ROWS, prof_now() - start); }
+    editor_draw_statusbar(&ab);
+    editor_draw_msg_bar(&ab);
+    char buf[32] = {0};
+    unsigned len = snprintf(buf, sizeof(buf), "\x1b[%zu;%zuH",
+                            (editor_cfg.buf->cy - editor_cfg.buf->row_offset + 1),
+                            (editor_cfg.buf->rx - editor_cfg.buf->col_offset + 1));
+    abuf_append(&ab, buf, len);
+    abuf_append(&ab, "\x1b[?25h", 6);
+    if (editor_cfg.sync_output) { abuf_append(&ab, "\x1b[?2026l", 8); }
+    start = prof_now();
+    write(STDOUT_FILENO, ab.data, ab.len);
+    editor_pacer_update(prof_now() - start, ab.len);
+    if (editor_prof.enabled) { editor_prof_frame(start, ab.len); }
+    editor_pacer.pending = false;
+    abuf_free(&ab);
+    ALLOC_LEAVE();
+}
+
+void editor_set_status_msg(const char *fmt, ...) {
+    va_list vargs;
+    va_start(vargs, fmt);
+    vsnprintf(editor_cfg.status_msg, sizeof(editor_cfg.status_msg), fmt, vargs);
+    va_end(vargs);
+    editor_cfg.status_msg_time = time(NULL);
+}
+
+char *editor_rows_to_string(size_t *buflen) {
+    size_t total_len = 0;
+
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) {
+        total_len += editor_cfg.buf->erows[j].size + 1;
+    }
+
+    *buflen = total_len;
+    char *buf = (char *)calloc(total_len, sizeof(char));
+    char *ptr = buf;
+
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) {
+        memcpy(ptr, editor_cfg.buf->erows[j].chars, editor_cfg.buf->erows[j].size);
+        ptr += editor_cfg.buf->erows[j].size;
+        *ptr = '\n';
+        ptr++;
+    }
+
+    return buf;
+}
+
+void editor_insert_char(unsigned chr) {
+    if (editor_cfg.buf->cy == editor_cfg.buf->num_erows) {
+        editor_insert_row(editor_cfg.buf->num_erows, "", 0);
+    }
+    editor_row_insert_char(&editor_cfg.buf->erows[editor_cfg.buf->cy], editor_cfg.buf->cx, chr);
+    editor_cfg.buf->cx += 1;
+}
+
+void editor_insert_newline() {
+    if (editor_cfg.buf->cx == 0) {
+        editor_insert_row(editor_cfg.buf->cy, "", 0);
+    } else {
+        editor_split_row(editor_cfg.buf->cy, editor_cfg.buf->cx);
+    }
+
+    editor_cfg.buf->cy += 1;
+    editor_cfg.buf->cx = 0;
+}
+
+void editor_del_char() {
+    if (editor_cfg.buf->cy == editor_cfg.buf->num_erows) { return; }
+    if (editor_cfg.buf->cx == 0 && editor_cfg.buf->cy == 0) { return; }
+    editor_row_t *erow = &editor_cfg.buf->erows[editor_cfg.buf->cy];
+    if (editor_cfg.buf->cx > 0) {
+        size_t start = editor_row_prev_cp(erow, editor_cfg.buf->cx);
+        while (editor_cfg.buf->cx > start) {
+            editor_cfg.buf->cx -= 1;
+            editor_row_del_char(erow, editor_cfg.buf->cx);
+        }
+    } else {
+        editor_cfg.buf->cx = editor_cfg.buf->erows[editor_cfg.buf->cy - 1].size;
+        editor_join_row(editor_cfg.buf->cy);
+        editor_cfg.buf->cy -= 1;
+    }
+}
+
+bool editor_journal_read_varint(const char **ptr, const char *end, uint64_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; *ptr < end && shift < 64; shift += 7) {
+        unsigned char byte = *(*ptr)++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) { return true; }
+    }
+
+    return false;
+}
+
+bool editor_journal_apply(enum editor_edit_op op, uint64_t row, uint64_t col, char *data, uint64_t len) {
+    size_t num = editor_cfg.buf->num_erows;
+    switch (op) {
+        case EDIT_INSERT_CHAR:
+            if (row >= num || len != 1) { return false; }
+            editor_row_insert_char(&editor_cfg.buf->erows[row], col, (unsigned char)data[0]);
+            return true;
+        case EDIT_DELETE_CHAR:
+            if (row >= num) { return false; }
+            editor_row_del_char(&editor_cfg.buf->erows[row], col);
+            return true;
+        case EDIT_INSERT_ROW:
+            if (row > num) { return false; }
+            editor_insert_row(row, data, len);
+            return true;
+        case EDIT_DELETE_ROW:
+            if (row >= num) { return false; }
+            editor_del_row(row);
+            return true;
+        case EDIT_APPEND_STRING:
+            if (row >= num) { return false; }
+            editor_row_append_string(&editor_cfg.buf->erows[row], data, len);
+            return true;
+        case EDIT_SPLIT_ROW:
+            if (row >= num || col > editor_cfg.buf->erows[row].size) { return false; }
+            editor_split_row(row, col);
+            return true;
+        case EDIT_JOIN_ROW:
+            if (row == 0 || row >= num) { return false; }
+            editor_join_row(row);
+            return true;
+        case EDIT_INSERT_TEXT:
+            if (row >= num || col > editor_cfg.buf->erows[row].size) { return false; }
+            editor_insert_text(row, col, data, len);
+            return true;
+        case EDIT_DELETE_TEXT: {
+            size_t end_row = 0;
+            size_t end_col = 0;
+            undo_text_end(row, col, data, len, &end_row, &end_col);
+            if (end_row >= num || col > editor_cfg.buf->erows[row].size || end_col > editor_cfg.buf->erows[end_row].size) {
+                return false;
+            }
+            editor_delete_text(row, col, data, len);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Replays a journal left behind by a session that did not exit cleanly. Only a journal
+ * written against the file as it is on disk now is replayed; anything else is set
+ * aside as .old. Replay stops at the first incomplete or inconsistent record. */
+void editor_journal_recover() {
+    if (editor_cfg.buf->journal.failed) { return; }
+    char *path = editor_journal_path(editor_cfg.buf->filename);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) { close(fd); }
+        free(path);
+        return;
+    }
+
+    char *buf = malloc(st.st_size + 1);
+    size_t len = 0;
+    ssize_t nread = 0;
+    while (len < (size_t)st.st_size && (nread = read(fd, &buf[len], st.st_size - len)) > 0) { len += nread; }
+    close(fd);
+
+    editor_journal_header_t hdr;
+    editor_journal_header_t cur;
+    editor_journal_header(editor_cfg.buf->filename, &cur);
+    if (len >= sizeof(hdr)) { memcpy(&hdr, buf, sizeof(hdr)); }
+    if (len >= sizeof(hdr) && hdr.pid != cur.pid && kill(hdr.pid, 0) == 0 &&
+        memcmp(hdr.magic, cur.magic, sizeof(hdr.magic)) == 0) {
+        editor_cfg.buf->journal.failed = true;
+        editor_set_status_msg("Journal %s is in use by pid %lld; not journaling", path, (long long)hdr.pid);
+        free(buf);
+        free(path);
+        return;
+    }
+
+    if (len < sizeof(hdr) || memcmp(hdr.magic, cur.magic, sizeof(hdr.magic)) != 0 ||
+        hdr.size != cur.size || hdr.mtime_sec != cur.mtime_sec ||
+        hdr.mtime_nsec != cur.mtime_nsec || hdr.inode != cur.inode) {
+        size_t old_len = strlen(path) + sizeof(".old");
+        char *old = malloc(old_len);
+        snprintf(old, old_len, "%s.old", path);
+        rename(path, old);
+        editor_set_status_msg("Journal does not match %s; moved to %s", editor_cfg.buf->filename, old);
+        free(old);
+        free(buf);
+        free(path);
+        return;
+    }
+
+    const char *ptr = &buf[sizeof(hdr)];
+    const char *end = &buf[len];
+    const char *good = ptr;
+    size_t edits = 0;
+    editor_cfg.edit_nesting += 1;
+    while (ptr < end) {
+        enum editor_edit_op op = (unsigned char)*ptr++;
+        uint64_t row = 0;
+        uint64_t col = 0;
+        uint64_t data_len = 0;
+        if (!editor_journal_read_varint(&ptr, end, &row) || !editor_journal_read_varint(&ptr, end, &col) ||
+            !editor_journal_read_varint(&ptr, end, &data_len) || data_len > (uint64_t)(end - ptr)) {
+            break;
+        }
+
+        if (!editor_journal_apply(op, row, col, (char *)ptr, data_len)) { break; }
+        ptr += data_len;
+        good = ptr;
+        edits += 1;
+    }
+    editor_cfg.edit_nesting -= 1;
+
+    /* Keep journaling into the same file, dropping any torn record at its tail */
+    editor_cfg.buf->journal.path = path;
+    editor_cfg.buf->journal.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    if (editor_cfg.buf->journal.fd != -1) {
+        if (ftruncate(editor_cfg.buf->journal.fd, good - buf) == -1) { editor_journal_discard(); }
+    }
+    if (editor_cfg.buf->journal.fd != -1) {
+        cur.pid = getpid();
+        pwrite(editor_cfg.buf->journal.fd, &cur, sizeof(cur), 0);
+    }
+
+    free(buf);
+    if (edits > 0) {
+        editor_cfg.buf->dirty = true;
+        editor_set_status_msg("Recovered %zu edits from %s", edits, path);
+    }
+}
+
+/* FNV-1a over the first and last KILO_INDEX_CHECK bytes of the indexed data, enough
+ * to tell a file that was only appended to from one that was rewritten */
+uint64_t editor_index_checksum(const char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    size_t head = size < KILO_INDEX_CHECK ? size : KILO_INDEX_CHECK;
+    size_t tail = size - head < KILO_INDEX_CHECK ? size - head : KILO_INDEX_CHECK;
+    for (size_t i = 0; i < head; i++) { hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ull; }
+    for (size_t i = size - tail; i < size; i++) { hash = (hash ^ (unsigned char)data[i]) * 0x100000001b3ull; }
+    return hash;
+}
+
+/* Indexes live in $XDG_CACHE_HOME/kilo (or ~/.cache/kilo), named after the device
+ * and inode of the file so renames and hard links share one index */
+char *editor_index_path(struct stat *st) {
+    char *cache = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    char dir[PATH_MAX] = {0};
+    if (cache != NULL && cache[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s", cache);
+    } else if (home != NULL && home[0] != '\0') {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+    } else {
+        return NULL;
+    }
+
+    mkdir(dir, 0700);
+    strncat(dir, "/kilo", sizeof(dir) - strlen(dir) - 1);
+    if (mkdir(dir, 0700) == -1 && errno != EEXIST) { return NULL; }
+
+    size_t len = strlen(dir) + 48;
+    char *path = malloc(len);
+    snprintf(path, len, "%s/%llx-%llx.idx", dir, (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return path;
+}
+
+void editor_index_push(editor_index_t *index, uint64_t offset, bool open) {
+    if (index->lines == index->cap) {
+        uint64_t cap = index->cap != 0 ? index->cap * 2 : 4096;
+        index->offsets = realloc(index->offsets, cap * sizeof(uint64_t));
+        index->states = realloc(index->states, cap / 8);
+        memset(&index->states[index->cap / 8], 0, (cap - index->cap) / 8);
+        index->cap = cap;
+    }
+
+    index->offsets[index->lines] = offset;
+    if (open) { index->states[index->lines / 8] |= 1 << (index->lines % 8); }
+    index->lines += 1;
+}
+
+bool editor_index_state(editor_index_t *index, uint64_t line) {
+    return index->states[line / 8] & (1 << (line % 8));
+}
+
+void editor_index_free(editor_index_t *index) {
+    if (index->map != NULL) {
+        munmap(index->map, index->map_len);
+    } else {
+        free(index->offsets);
+        free(index->states);
+    }
+
+    memset(index, 0, sizeof(*index));
+}
+
+/* Finds line starts and comment states from byte offset from onwards */
+void editor_index_scan(editor_index_t *index, const char *data, size_t size, uint64_t from) {
+    bool open = index->lines > 0 && editor_index_state(index, index->lines - 1);
+    while (from < size) {
+        const char *nl = memchr(&data[from], '\n', size - from);
+        size_t end = nl != NULL ? (size_t)(nl - data) : size;
+        open = editor_comment_state(&data[from], end - from, open);
+        editor_index_push(index, from, open);
+        from = end + 1;
+    }
+}
+
+void editor_index_write(editor_index_t *index, struct stat *st, const char *data) {
+    char *path = editor_index_path(st);
+    if (path == NULL) { return; }
+    size_t tmp_len = strlen(path) + 8;
+    char *tmp = malloc(tmp_len);
+    snprintf(tmp, tmp_len, "%s.%d", path, (int)getpid());
+
+    editor_index_header_t hdr = {0};
+    memcpy(hdr.magic, KILO_INDEX_MAGIC, sizeof(hdr.magic));
+    hdr.dev = st->st_dev;
+    hdr.inode = st->st_ino;
+    hdr.size = st->st_size;
+    hdr.mtime_sec = st->st_mtim.tv_sec;
+    hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    hdr.lines = index->lines;
+    hdr.checksum = editor_index_checksum(data, st->st_size);
+    if (editor_cfg.buf->syntax != NULL) { strncpy(hdr.syntax, editor_cfg.buf->syntax->filetype, sizeof(hdr.syntax) - 1); }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd != -1) {
+        size_t states = (index->lines + 7) / 8;
+        bool ok = editor_write_all(fd, (const char *)&hdr, sizeof(hdr)) &&
+                  editor_write_all(fd, (const char *)index->offsets, index->lines * sizeof(uint64_t)) &&
+                  editor_write_all(fd, (const char *)index->states, states);
+        close(fd);
+        if (!ok || rename(tmp, path) == -1) { unlink(tmp); }
+    }
+
+    free(tmp);
+    free(path);
+}
+
+/* Maps the cached index for a file and checks it is well formed */
+editor_index_header_t *editor_index_map(struct stat *st, editor_index_t *index) {
+    char *path = editor_index_path(st);
+    if (path == NULL) { return NULL; }
+    int fd = open(path, O_RDONLY);
+    free(path);
+    if (fd == -1) { return NULL; }
+
+    struct stat ist;
+    editor_index_header_t *hdr = NULL;
+    if (fstat(fd, &ist) == 0 && (size_t)ist.st_size >= sizeof(editor_index_header_t)) {
+        hdr = mmap(NULL, ist.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (hdr == MAP_FAILED) { hdr = NULL; }
+    }
+    close(fd);
+    if (hdr == NULL) { return NULL; }
+
+    index->map = hdr;
+    index->map_len = ist.st_size;
+    uint64_t lines = hdr->lines;
+    if (memcmp(hdr->magic, KILO_INDEX_MAGIC, sizeof(hdr->magic)) != 0 || hdr->dev != (uint64_t)st->st_dev ||
+        hdr->inode != (uint64_t)st->st_ino || lines > hdr->size ||
+        index->map_len != sizeof(editor_index_header_t) + lines * sizeof(uint64_t) + (lines + 7) / 8) {
+        editor_index_free(index);
+        return NULL;
+    }
+
+    index->offsets = (uint64_t *)&hdr[1];
+    index->states = (unsigned char *)&index->offsets[lines];
+    for (uint64_t j = 0; j < lines; j++) {
+        if (index->offsets[j] >= hdr->size || (j > 0 && index->offsets[j] <= index->offsets[j - 1])) {
+            editor_index_free(index);
+            return NULL;
+        }
+    }
+
+    return hdr;
+}
+
+/* Produces the line index of a file, reusing the cached one when the file is
+ * unchanged and extending it when the file was only appended to. Revalidation is
+ * a header compare, plus a checksum of at most 8KB for a grown file. */
+void editor_index_load(editor_index_t *index, struct stat *st, const char *data) {
+    size_t size = st->st_size;
+    if (size < KILO_INDEX_MIN_SIZE) {
+        editor_index_scan(index, data, size, 0);
+        return;
+    }
+
+    char syntax[16] = {0};
+    if (editor_cfg.buf->syntax != NULL) { strncpy(syntax, editor_cfg.buf->syntax->filetype, sizeof(syntax) - 1); }
+    editor_index_header_t *hdr = editor_index_map(st, index);
+    if (hdr != NULL && memcmp(hdr->syntax, syntax, sizeof(syntax)) == 0) {
+        if (hdr->size == size && hdr->mtime_sec == st->st_mtim.tv_sec && hdr->mtime_nsec == st->st_mtim.tv_nsec) {
+            index->lines = hdr->lines;
+            return;
+        }
 
-    for (unsigned j = at + 1; j <= editor_cfg.num_erows; j++) {
-        editor_cfg.erows[j].idx += 1;
+        if (hdr->size < size && hdr->checksum == editor_index_checksum(data, hdr->size)) {
+            uint64_t keep = hdr->lines;
+            if (keep > 0 && data[hdr->size - 1] != '\n') { keep -= 1; }
+            uint64_t from = keep < hdr->lines ? index->offsets[keep] : hdr->size;
+            editor_index_t grown = {0};
+            grown.cap = 4096;
+            while (grown.cap < keep + 1) { grown.cap *= 2; }
+            grown.offsets = malloc(grown.cap * sizeof(uint64_t));
+            grown.states = calloc(grown.cap / 8, 1);
+            memcpy(grown.offsets, index->offsets, keep * sizeof(uint64_t));
+            memcpy(grown.states, index->states, (keep + 7) / 8);
+            if (keep % 8 != 0) { grown.states[keep / 8] &= (1 << (keep % 8)) - 1; }
+            grown.lines = keep;
+            editor_index_free(index);
+            *index = grown;
+            editor_index_scan(index, data, size, from);
+            editor_index_write(index, st, data);
+            return;
+        }
     }
 
-    editor_cfg.erows[at].idx = at;
-    editor_cfg.erows[at].size = len;
-    editor_cfg.erows[at].chars = (char *)calloc(len + 1, sizeof(char));
-    memcpy(editor_cfg.erows[at].chars, str, len);
-    editor_cfg.erows[at].chars[len] = '\0';
-    editor_cfg.erows[at].rsize = 0;
-    editor_cfg.erows[at].render = NULL;
-    editor_cfg.erows[at].highlight = NULL;
-    editor_cfg.erows[at].hl_open_comment = false;
-    editor_update_row(&editor_cfg.erows[at]);
-    editor_cfg.num_erows += 1;
-    editor_cfg.dirty = true;
+    if (hdr != NULL) { editor_index_free(index); }
+    editor_index_scan(index, data, size, 0);
+    editor_index_write(index, st, data);
 }
 
-void editor_free_row(editor_row_t *erow) {
-    free(erow->highlight);
-    free(erow->render);
-    free(erow->chars);
-}
+/* Creates rows straight from the line index. Each row is allocated at its exact size
+ * and keeps only its comment state; it is rendered and highlighted when first drawn.
+ * A cached index is only trusted as far as its checksum reaches, so every line
+ * boundary is checked against the bytes being copied; on a mismatch the rows are
+ * dropped and false returned. */
+bool editor_load_rows(editor_index_t *index, const char *data, size_t size) {
+    size_t first = editor_cfg.buf->num_erows;
+    editor_reserve_rows(editor_cfg.buf->num_erows + index->lines);
+    for (uint64_t j = 0; j < index->lines; j++) {
+        size_t start = index->offsets[j];
+        size_t end = j + 1 < index->lines ? index->offsets[j + 1] - 1 : size;
+        if ((j == 0 && start != 0) || (end < size && data[end] != '\n')) {
+            while (editor_cfg.buf->num_erows > first) { editor_free_row(&editor_cfg.buf->erows[--editor_cfg.buf->num_erows]); }
+            return false;
+        }
 
-void editor_del_row(unsigned at) {
-    if (at >= editor_cfg.num_erows) { return; }
-    editor_free_row(&editor_cfg.erows[at]);
-    memmove(&editor_cfg.erows[at], &editor_cfg.erows[at + 1], sizeof(editor_row_t) * (editor_cfg.num_erows - at - 1));
+        if (end == size && size > 0 && data[size - 1] == '\n') { end -= 1; }
+        while (end > start && data[end - 1] == '\r') { end -= 1; }
 
-    for (unsigned j = at; j < editor_cfg.num_erows - 1; j++) {
-        editor_cfg.erows[j].idx -= 1;
+        editor_row_t *erow = &editor_cfg.buf->erows[editor_cfg.buf->num_erows];
+        erow->idx = editor_cfg.buf->num_erows;
+        erow->size = end - start;
+        erow->chars = (char *)editor_pool_alloc(erow->size + 1);
+        memcpy(erow->chars, &data[start], erow->size);
+        erow->chars[erow->size] = '\0';
+        erow->rsize = 0;
+        erow->render = NULL;
+        erow->highlight = NULL;
+        erow->hl_open_comment = editor_index_state(index, j);
+        erow->ascii = false;
+        editor_cfg.buf->num_erows += 1;
     }
 
-    editor_cfg.num_erows -= 1;
-    editor_cfg.dirty = true;
+    return true;
 }
 
-void editor_row_insert_char(editor_row_t *erow, unsigned at, unsigned chr) {
-    if (at < 0 || at > erow->size) { at = erow->size; }
-    erow->chars = (char *)realloc(erow->chars, erow->size + 2);
-    memmove(&erow->chars[at + 1], &erow->chars[at], erow->size - at + 1);
-    erow->size += 1;
-    erow->chars[at] = chr;
-    editor_update_row(erow);
-    editor_cfg.dirty = true;
+void editor_open(char *filename) {
+    ALLOC_ENTER(ALLOC_OP_OPEN);
+    free(editor_cfg.buf->filename);
+    editor_cfg.buf->filename = strdup(filename);
+    editor_select_syntax();
+    editor_cfg.edit_nesting += 1;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) { die("editor_open :: open"); }
+    struct stat st;
+    if (fstat(fd, &st) == -1) { die("editor_open :: fstat"); }
+    size_t size = st.st_size;
+    char *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) { die("editor_open :: mmap"); }
+    }
+    close(fd);
+
+    editor_index_t index = {0};
+    editor_index_load(&index, &st, data);
+    if (!editor_load_rows(&index, data, size)) {
+        editor_index_free(&index);
+        editor_index_scan(&index, data, size, 0);
+        editor_index_write(&index, &st, data);
+        editor_load_rows(&index, data, size);
+    }
+    editor_index_free(&index);
+    editor_cfg.buf->follow.offset = size;
+    editor_cfg.buf->follow.partial = size > 0 && data[size - 1] != '\n';
+    if (data != NULL) { munmap(data, size); }
+    editor_cfg.edit_nesting -= 1;
+    editor_cfg.buf->dirty = false;
+    editor_journal_recover();
+    ALLOC_LEAVE();
 }
 
-void editor_row_append_string(editor_row_t *erow, char *str, size_t len) {
-    erow->chars = (char *)realloc(erow->chars, erow->size + len + 1);
-    memcpy(&erow->chars[erow->size], str, len);
-    erow->size += len;
-    erow->chars[erow->size] = '\0';
-    editor_update_row(erow);
-    editor_cfg.dirty = true;
+void editor_follow_watch() {
+    editor_cfg.buf->follow.watch = inotify_add_watch(editor_cfg.buf->follow.fd, editor_cfg.buf->filename,
+        IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF);
 }
 
-void editor_row_del_char(editor_row_t *erow, unsigned at) {
-    if (at >= erow->size) { return; }
-    memmove(&erow->chars[at], &erow->chars[at + 1], erow->size - at);
-    erow->size -= 1;
-    editor_update_row(erow);
-    editor_cfg.dirty = true;
+void editor_follow_stop() {
+    if (editor_cfg.buf->follow.fd != -1) { close(editor_cfg.buf->follow.fd); }
+    editor_cfg.buf->follow.enabled = false;
+    editor_cfg.buf->follow.fd = -1;
+    editor_cfg.buf->follow.watch = -1;
 }
 
-void editor_draw_rows(abuf *ab) {
-    for (unsigned y = 0; y < editor_cfg.screen_rows; y++) {
-        unsigned file_row = y + editor_cfg.row_offset;
-        if (file_row >= editor_cfg.num_erows) {
-            if (editor_cfg.num_erows == 0 && y == editor_cfg.screen_rows / 3) {
-                char welcome[80] = {0};
-                unsigned welcome_len = snprintf( welcome, sizeof(welcome), "Kilo Editor -- version %s", KILO_VERSION);
-                if (welcome_len > editor_cfg.screen_cols) { welcome_len = editor_cfg.screen_cols; }
-                unsigned padding = (editor_cfg.screen_cols - welcome_len) / 2;
-                if (padding != 0) { abuf_append(ab, "~", 1); }
-                while (padding--) { abuf_append(ab, " ", 1); }
-                abuf_append(ab, welcome, welcome_len);
-
-            } else {
-                abuf_append(ab, "~", 1);
-            }
-        } else {
-            long len = editor_cfg.erows[file_row].rsize - editor_cfg.col_offset;
-            if (len < 0) { len = 0; }
-            if (len > editor_cfg.screen_cols) { len = editor_cfg.screen_cols; }
-            char *chr = &editor_cfg.erows[file_row].render[editor_cfg.col_offset];
-            unsigned char *hl = &editor_cfg.erows[file_row].highlight[editor_cfg.col_offset];
-            int current_colour = -1;
-
-            for (unsigned i = 0; i < len; i++) {
-                if (iscntrl(chr[i])) {
-                    char sym = (chr[i] <= 26) ? '@' + chr[i] : '?';
-                    abuf_append(ab, "\x1b[7m", 4);
-                    abuf_append(ab, &sym, 1);
-                    abuf_append(ab, "\x1b[m", 3);
-                    if (current_colour != -1) {
-                        char buf[16] = {0};
-                        unsigned clen = snprintf(buf, sizeof(buf), "\x1b]%dm", current_colour);
-                        abuf_append(ab, buf, clen);
-                    }
-                } else if (hl[i] == HL_NORMAL) {
-                    if (current_colour != -1) {
-                        abuf_append(ab, "\x1b[39m", 5);
-                        current_colour = -1;
-                    }
-                    abuf_append(ab, &chr[i], 1);
-                } else {
-                    int colour = editor_highlight_to_colour(hl[i]);
-                    if (colour != current_colour) {
-                        current_colour = colour;
-                        char buf[16] = {0};
-                        unsigned colour_len = snprintf(buf, sizeof(buf), "\x1b[%um", colour);
-                        abuf_append(ab, buf, colour_len);
-                    }
-                    abuf_append(ab, &chr[i], 1);
-                }
-            }
-            abuf_append(ab, "\x1b[39m", 5);
-        }
+void editor_follow_start() {
+    if (editor_cfg.buf->filename == NULL) {
+        editor_set_status_msg("Follow needs a file");
+        return;
+    }
 
-        abuf_append(ab, "\x1b[K", 3);
-        abuf_append(ab, "\r\n", 2);
+    struct stat st;
+    editor_cfg.buf->follow.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (editor_cfg.buf->follow.fd == -1 || stat(editor_cfg.buf->filename, &st) == -1) {
+        editor_follow_stop();
+        editor_set_status_msg("Can't follow! %s", strerror(errno));
+        return;
     }
+
+    editor_cfg.buf->follow.enabled = true;
+    editor_cfg.buf->follow.inode = st.st_ino;
+    editor_follow_watch();
 }
 
-void editor_scroll() {
-    editor_cfg.rx = 0;
+void editor_follow_reload() {
+    char *filename = strdup(editor_cfg.buf->filename);
+    editor_journal_discard();
+    editor_undo_free();
+    editor_free_rows();
+    editor_open(filename);
+    free(filename);
+    if (editor_cfg.buf->cy > editor_cfg.buf->num_erows) { editor_cfg.buf->cy = editor_cfg.buf->num_erows; }
+    editor_cfg.buf->cx = 0;
+}
 
-    if (editor_cfg.cy < editor_cfg.num_erows) {
-        editor_cfg.rx = editor_row_cx_to_rx(&editor_cfg.erows[editor_cfg.cy], editor_cfg.cx);
+/* Picks up whatever happened to the followed file since the last update. Appended
+ * bytes are read from the last known offset; truncation or a new inode (rotation)
+ * reloads the file. Only the new data is read and rendered on the append path. */
+void editor_follow_update() {
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool moved = false;
+    ssize_t nread = 0;
+    while ((nread = read(editor_cfg.buf->follow.fd, events, sizeof(events))) > 0) {
+        for (char *ptr = events; ptr < events + nread;) {
+            struct inotify_event *event = (struct inotify_event *)ptr;
+            if (event->mask & (IN_MOVE_SELF | IN_DELETE_SELF | IN_IGNORED)) { moved = true; }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
     }
 
-    if (editor_cfg.cy < editor_cfg.row_offset) { editor_cfg.row_offset = editor_cfg.cy; }
-
-    if (editor_cfg.cy >= editor_cfg.row_offset + editor_cfg.screen_rows) {
-        editor_cfg.row_offset = editor_cfg.cy - editor_cfg.screen_rows + 1;
+    if (moved && editor_cfg.buf->follow.watch != -1) {
+        inotify_rm_watch(editor_cfg.buf->follow.fd, editor_cfg.buf->follow.watch);
+        editor_cfg.buf->follow.watch = -1;
     }
 
-    if (editor_cfg.rx < editor_cfg.col_offset) { editor_cfg.col_offset = editor_cfg.rx; }
+    struct stat st;
+    if (stat(editor_cfg.buf->filename, &st) == -1) { return; }
+    if (editor_cfg.buf->follow.watch == -1) { editor_follow_watch(); }
+
+    if (st.st_ino != editor_cfg.buf->follow.inode || st.st_size < editor_cfg.buf->follow.offset) {
+        if (editor_cfg.buf->dirty) {
+            editor_follow_stop();
+            editor_set_status_msg("File was truncated or replaced; follow stopped to keep your changes");
+            return;
+        }
 
-    if (editor_cfg.rx >= editor_cfg.col_offset + editor_cfg.screen_cols) {
-        editor_cfg.col_offset = editor_cfg.rx - editor_cfg.screen_cols + 1;
+        editor_cfg.buf->follow.inode = st.st_ino;
+        editor_follow_reload();
+        editor_set_status_msg("File was truncated or replaced; reloaded");
+        return;
     }
-}
 
-void editor_draw_statusbar(abuf *ab) {
-    abuf_append(ab, "\x1b[7m", 4);
-    char status[80] = {0};
-    char rstatus[80] = {0};
-    unsigned len =
-        snprintf(status, sizeof(status), "%.20s - %u lines %s",
-                 editor_cfg.filename != NULL ? editor_cfg.filename : "[No Name]",
-                 editor_cfg.num_erows, editor_cfg.dirty ? "(modified)" : "");
-    unsigned rlen = snprintf(rstatus, sizeof(rstatus), "%s | %u/%u",
-                 editor_cfg.syntax != NULL ? editor_cfg.syntax->filetype : "no ft",
-                 editor_cfg.cy + 1, editor_cfg.num_erows);
-    if (len > editor_cfg.screen_cols) { len = editor_cfg.screen_cols; }
-    abuf_append(ab, status, len);
-    while (len < editor_cfg.screen_cols) {
-        if (editor_cfg.screen_cols - len == rlen) {
-            abuf_append(ab, rstatus, rlen);
-            break;
-        } else {
-            abuf_append(ab, " ", 1);
-            len += 1;
-        }
+    if (st.st_size == editor_cfg.buf->follow.offset) { return; }
+    int fd = open(editor_cfg.buf->filename, O_RDONLY);
+    if (fd == -1) { return; }
+
+    bool at_end = editor_cfg.buf->cy + 1 >= editor_cfg.buf->num_erows;
+    char *buf = malloc(KILO_FOLLOW_CHUNK);
+    while (editor_cfg.buf->follow.offset < st.st_size) {
+        nread = pread(fd, buf, KILO_FOLLOW_CHUNK, editor_cfg.buf->follow.offset);
+        if (nread <= 0) { break; }
+        editor_append_rows(buf, nread, editor_cfg.buf->follow.partial);
+        editor_cfg.buf->follow.offset += nread;
+        editor_cfg.buf->follow.partial = buf[nread - 1] != '\n';
     }
 
-    abuf_append(ab, "\x1b[m", 3);
-    abuf_append(ab, "\r\n", 2);
+    free(buf);
+    close(fd);
+    if (at_end && editor_cfg.buf->num_erows > 0) {
+        editor_cfg.buf->cy = editor_cfg.buf->num_erows - 1;
+        editor_cfg.buf->cx = 0;
+    }
 }
 
-void editor_draw_msg_bar(abuf *ab) {
-    abuf_append(ab, "\x1b[K", 3);
-    unsigned msg_len = strlen(editor_cfg.status_msg);
-    if (msg_len > editor_cfg.screen_cols) { msg_len = editor_cfg.screen_cols; }
-
-    if (msg_len > 0 && time(NULL) - editor_cfg.status_msg_time < 5) {
-        abuf_append(ab, editor_cfg.status_msg, msg_len);
-    }
+int editor_follow_timeout_ms(int timeout) {
+    if (!editor_cfg.buf->follow.enabled || editor_cfg.buf->follow.watch != -1) { return timeout; }
+    return (timeout == -1 || timeout > KILO_FOLLOW_RETRY_MS) ? KILO_FOLLOW_RETRY_MS : timeout;
 }
 
-void editor_refresh_screen() {
-    editor_scroll();
-    abuf ab = ABUF_INIT;
-    abuf_append(&ab, "\x1b[?25l", 6);
-    abuf_append(&ab, "\x1b[H", 3);
-    editor_draw_rows(&ab);
-    editor_draw_statusbar(&ab);
-    editor_draw_msg_bar(&ab);
-    char buf[32] = {0};
-    unsigned len = snprintf(buf, sizeof(buf), "\x1b[%u;%uH",
-                            (editor_cfg.cy - editor_cfg.row_offset + 1),
-                            (editor_cfg.rx - editor_cfg.col_offset + 1));
-    abuf_append(&ab, buf, len);
-    abuf_append(&ab, "\x1b[?25h", 6);
-    write(STDOUT_FILENO, ab.data, ab.len);
-    abuf_free(&ab);
+// Forward declare editor_prompt()
+char *editor_prompt(char *prompt, void (*callback)(char *, unsigned), bool allow_empty);
+
+/* Makes another buffer current. Pending journal records of the one left behind are
+ * flushed; its rows, render and highlight caches and cursor stay as they are. */
+void editor_buffer_switch(unsigned idx) {
+    if (idx >= editor_cfg.num_buffers) { return; }
+    if (editor_cfg.buf != NULL) { editor_journal_flush(); }
+    editor_cfg.buf = editor_cfg.buffers[idx];
+    if (editor_cfg.buf->follow.enabled) { editor_follow_update(); }
+    editor_pacer.pending = true;
 }
 
-void editor_set_status_msg(const char *fmt, ...) {
-    va_list vargs;
-    va_start(vargs, fmt);
-    vsnprintf(editor_cfg.status_msg, sizeof(editor_cfg.status_msg), fmt, vargs);
-    va_end(vargs);
-    editor_cfg.status_msg_time = time(NULL);
+/* Appends an empty buffer to the buffer list and makes it current */
+editor_buffer_t *editor_buffer_new() {
+    editor_buffer_t *buf = (editor_buffer_t *)calloc(1, sizeof(editor_buffer_t));
+    buf->follow.fd = -1;
+    buf->follow.watch = -1;
+    buf->journal.fd = -1;
+    buf->journal.pending = (abuf)ABUF_INIT;
+    char *limit = getenv("KILO_UNDO_LIMIT");
+    buf->undo.limit = limit != NULL ? strtoull(limit, NULL, 10) : KILO_UNDO_LIMIT;
+
+    if (editor_cfg.num_buffers == editor_cfg.buffers_cap) {
+        editor_cfg.buffers_cap = editor_cfg.buffers_cap != 0 ? editor_cfg.buffers_cap * 2 : 8;
+        editor_cfg.buffers = realloc(editor_cfg.buffers, editor_cfg.buffers_cap * sizeof(editor_buffer_t *));
+    }
+
+    editor_cfg.buffers[editor_cfg.num_buffers] = buf;
+    editor_cfg.num_buffers += 1;
+    editor_buffer_switch(editor_cfg.num_buffers - 1);
+    return buf;
 }
 
-char *editor_rows_to_string(size_t *buflen) {
-    size_t total_len = 0;
+/* Closes the current buffer for good, dropping its journal, and moves to the next
+ * one. Closing the last buffer leaves an empty one behind. */
+void editor_buffer_close() {
+    editor_buffer_t *buf = editor_cfg.buf;
+    unsigned idx = editor_buffer_index();
+    editor_follow_stop();
+    editor_journal_discard();
+    free(buf->journal.pending.data);
+    editor_undo_free();
+    editor_free_rows();
+    free(buf->filename);
+
+    memmove(&editor_cfg.buffers[idx], &editor_cfg.buffers[idx + 1],
+            (editor_cfg.num_buffers - idx - 1) * sizeof(editor_buffer_t *));
+    editor_cfg.num_buffers -= 1;
+    editor_cfg.buf = NULL;
+    free(buf);
 
-    for (size_t j = 0; j < editor_cfg.num_erows; j++) {
-        total_len += editor_cfg.erows[j].size + 1;
+    if (editor_cfg.num_buffers == 0) {
+        editor_buffer_new();
+    } else {
+        editor_buffer_switch(idx < editor_cfg.num_buffers ? idx : editor_cfg.num_buffers - 1);
     }
+}
 
-    *buflen = total_len;
-    char *buf = (char *)calloc(total_len, sizeof(char));
-    char *ptr = buf;
+/* Opens a file in a buffer of its own, or switches to it when it is already open. A
+ * file that does not exist yet becomes an empty buffer that saving creates. */
+void editor_buffer_open(char *filename) {
+    for (unsigned j = 0; j < editor_cfg.num_buffers; j++) {
+        if (editor_cfg.buffers[j]->filename != NULL && strcmp(editor_cfg.buffers[j]->filename, filename) == 0) {
+            editor_buffer_switch(j);
+            return;
+        }
+    }
 
-    for (size_t j = 0; j < editor_cfg.num_erows; j++) {
-        memcpy(ptr, editor_cfg.erows[j].chars, editor_cfg.erows[j].size);
-        ptr += editor_cfg.erows[j].size;
-        *ptr = '\n';
-        ptr++;
+    bool exists = access(filename, F_OK) == 0;
+    if (exists && access(filename, R_OK) != 0) {
+        editor_set_status_msg("Can't open %s: %s", filename, strerror(errno));
+        return;
     }
 
-    return buf;
+    editor_buffer_t *buf = editor_cfg.buf;
+    if (buf == NULL || buf->filename != NULL || buf->num_erows != 0 || buf->dirty) { editor_buffer_new(); }
+    if (exists) {
+        editor_open(filename);
+    } else {
+        editor_cfg.buf->filename = strdup(filename);
+        editor_select_syntax();
+        editor_journal_recover();
+    }
 }
 
-void editor_insert_char(unsigned chr) {
-    if (editor_cfg.cy == editor_cfg.num_erows) {
-        editor_insert_row(editor_cfg.num_erows, "", 0);
+bool editor_buffers_dirty() {
+    for (unsigned j = 0; j < editor_cfg.num_buffers; j++) {
+        if (editor_cfg.buffers[j]->dirty) { return true; }
     }
-    editor_row_insert_char(&editor_cfg.erows[editor_cfg.cy], editor_cfg.cx, chr);
-    editor_cfg.cx += 1;
+
+    return false;
 }
 
-void editor_insert_newline() {
-    if (editor_cfg.cx == 0) {
-        editor_insert_row(editor_cfg.cy, "", 0);
-    } else {
-        editor_row_t *erow = &editor_cfg.erows[editor_cfg.cy];
-        editor_insert_row(editor_cfg.cy + 1, &erow->chars[editor_cfg.cx], erow->size - editor_cfg.cx);
-        erow = &editor_cfg.erows[editor_cfg.cy];
-        erow->size = editor_cfg.cx;
-        erow->chars[erow->size] = '\0';
-        editor_update_row(erow);
+/* Lists the buffers with their memory use and switches to the one picked */
+void editor_buffer_pick() {
+    char prompt[512] = {0};
+    size_t len = 0;
+    for (unsigned j = 0; j < editor_cfg.num_buffers && len < sizeof(prompt) - 64; j++) {
+        editor_buffer_t *buf = editor_cfg.buffers[j];
+        char mem[16] = {0};
+        editor_format_bytes(mem, sizeof(mem), editor_buffer_memory(buf));
+        const char *name = buf->filename != NULL ? buf->filename : "[No Name]";
+        const char *base = strrchr(name, '/');
+        len += snprintf(&prompt[len], sizeof(prompt) - len, "%s%u:", buf == editor_cfg.buf ? ">" : "", j + 1);
+        for (const char *c = base != NULL ? base + 1 : name; *c != '\0' && len < sizeof(prompt) - 48; c++) {
+            if (*c == '%') { prompt[len++] = '%'; }
+            prompt[len++] = *c;
+        }
+        len += snprintf(&prompt[len], sizeof(prompt) - len, "%s %s  ", buf->dirty ? "*" : "", mem);
     }
 
-    editor_cfg.cy += 1;
-    editor_cfg.cx = 0;
+    snprintf(&prompt[len], sizeof(prompt) - len, "| Buffer: %%s");
+    char *query = editor_prompt(prompt, NULL, false);
+    if (query == NULL) { return; }
+    unsigned long idx = strtoul(query, NULL, 10);
+    if (idx >= 1 && idx <= editor_cfg.num_buffers) { editor_buffer_switch(idx - 1); }
+    free(query);
 }
 
-void editor_del_char() {
-    if (editor_cfg.cy == editor_cfg.num_erows) { return; }
-    if (editor_cfg.cx == 0 && editor_cfg.cy == 0) { return; }
-    editor_row_t *erow = &editor_cfg.erows[editor_cfg.cy];
-    if (editor_cfg.cx > 0) {
-        editor_row_del_char(erow, editor_cfg.cx - 1);
-        editor_cfg.cx -= 1;
-    } else {
-        editor_cfg.cx = editor_cfg.erows[editor_cfg.cy - 1].size;
-        editor_row_append_string(&editor_cfg.erows[editor_cfg.cy - 1], erow->chars, erow->size);
-        editor_del_row(editor_cfg.cy);
-        editor_cfg.cy -= 1;
+void editor_undo() {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    editor_undo_boundary();
+    if (undo->count == 0) {
+        editor_set_status_msg("Nothing to undo");
+        return;
     }
-}
 
-void editor_open(char *filename) {
-    free(editor_cfg.filename);
-    editor_cfg.filename = strdup(filename);
-    editor_select_syntax();
-    FILE *fp = fopen(filename, "r");
-    if (fp == NULL) { die("editor_open :: fopen"); }
-    char *line = NULL;
-    size_t line_cap = 0;
-    ssize_t line_len = 0;
-
-    if (line_len != -1) {
-        while ((line_len = getline(&line, &line_cap, fp)) != -1) {
-            while (line_len > 0 && (line[line_len - 1] == '\n' || line[line_len - 1] == '\r')) {
-                line_len -= 1;
-            }
+    uint64_t group = undo->records[undo->count - 1].group;
+    undo->applying = true;
+    while (undo->count > 0 && undo->records[undo->count - 1].group == group) {
+        undo->count -= 1;
+        editor_undo_apply(&undo->records[undo->count], false);
+    }
+    undo->applying = false;
+}
 
-            editor_insert_row(editor_cfg.num_erows, line, line_len);
-        }
+void editor_redo() {
+    editor_undo_t *undo = &editor_cfg.buf->undo;
+    editor_undo_boundary();
+    if (undo->count == undo->total) {
+        editor_set_status_msg("Nothing to redo");
+        return;
     }
 
-    free(line);
-    fclose(fp);
-    editor_cfg.dirty = false;
+    uint64_t group = undo->records[undo->count].group;
+    undo->applying = true;
+    while (undo->count < undo->total && undo->records[undo->count].group == group) {
+        editor_undo_apply(&undo->records[undo->count], true);
+        undo->count += 1;
+    }
+    undo->applying = false;
 }
 
-// Forward declare editor_prompt()
-char *editor_prompt(char *prompt, void (*callback)(char *, unsigned));
+/* Refreshes the line index from the rows just written, so the next open of a large
+ * file does not have to rescan it */
+void editor_save_index(int fd, const char *buf, size_t len) {
+    struct stat st;
+    if (len < KILO_INDEX_MIN_SIZE || fstat(fd, &st) == -1) { return; }
+    editor_index_t index = {0};
+    uint64_t offset = 0;
+    for (size_t j = 0; j < editor_cfg.buf->num_erows; j++) {
+        editor_index_push(&index, offset, editor_cfg.buf->erows[j].hl_open_comment);
+        offset += editor_cfg.buf->erows[j].size + 1;
+    }
+
+    editor_index_write(&index, &st, buf);
+    editor_index_free(&index);
+}
 
 void editor_save() {
-    if (editor_cfg.filename == NULL) {
-        editor_cfg.filename = editor_prompt("Save as: %s (ESC to cancel)", NULL);
-        if (editor_cfg.filename == NULL) {
+    if (editor_cfg.buf->filename == NULL) {
+        editor_cfg.buf->filename = editor_prompt("Save as: %s (ESC to cancel)", NULL, false);
+        if (editor_cfg.buf->filename == NULL) {
             editor_set_status_msg("Saved aborted");
             return;
         }
@@ -703,13 +3309,17 @@ void editor_save() {
 
     size_t len = 0;
     char *buf = editor_rows_to_string(&len);
-    int fd = open(editor_cfg.filename, O_RDWR | O_CREAT, 0644);
+    int fd = open(editor_cfg.buf->filename, O_RDWR | O_CREAT, 0644);
     if (fd != -1) {
         if (ftruncate(fd, len) != -1) {
-            if ((size_t)write(fd, buf, len) == len) {
+            if (editor_write_all(fd, buf, len)) {
+                editor_save_index(fd, buf, len);
                 close(fd);
                 free(buf);
-                editor_cfg.dirty = false;
+                editor_cfg.buf->dirty = false;
+                editor_journal_discard();
+                editor_cfg.buf->follow.offset = len;
+                editor_cfg.buf->follow.partial = false;
                 editor_set_status_msg("%zu bytes written to disk", len);
                 return;
             }
@@ -722,18 +3332,18 @@ void editor_save() {
 }
 
 void editor_find_callback(char *query, unsigned key) {
-    static long last_match = -1;
+    static size_t last_match = SIZE_MAX;
     static short direction = 1;
-    static unsigned saved_hl_line = 0;
+    static size_t saved_hl_line = 0;
     static char *saved_hl = NULL;
     if (saved_hl != NULL) {
-        memcpy(editor_cfg.erows[saved_hl_line].highlight, saved_hl, editor_cfg.erows[saved_hl_line].rsize);
+        memcpy(editor_cfg.buf->erows[saved_hl_line].highlight, saved_hl, editor_cfg.buf->erows[saved_hl_line].rsize);
         free(saved_hl);
         saved_hl = NULL;
     }
 
     if (key == '\r' || key == '\x1b') {
-        last_match = -1;
+        last_match = SIZE_MAX;
         direction = 1;
         return;
     } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
@@ -741,45 +3351,267 @@ void editor_find_callback(char *query, unsigned key) {
     } else if (key == ARROW_LEFT || key == ARROW_UP) {
         direction = -1;
     } else {
-        last_match = -1;
+        last_match = SIZE_MAX;
         direction = 1;
     }
 
-    if (last_match == -1) { direction = 1; }
-    long current = last_match;
-    for (unsigned i = 0; i < editor_cfg.num_erows; i++) {
-        current += direction;
-        if (current == -1) {
-            current = editor_cfg.num_erows - 1;
-        } else if (current == editor_cfg.num_erows) { current = 0; }
-        editor_row_t *erow = &editor_cfg.erows[current];
-        char *match = strstr(erow->render, query);
+    if (last_match == SIZE_MAX) { direction = 1; }
+    /* Render only differs from chars by expanding tabs to spaces, so without a space
+     * in the query a row whose chars do not match can be skipped unrendered */
+    size_t query_len = strlen(query);
+    bool skip_unrendered = strchr(query, ' ') == NULL;
+    size_t num = editor_cfg.buf->num_erows;
+    size_t current = last_match;
+    for (size_t i = 0; i < num; i++) {
+        if (direction == 1) {
+            current = current == SIZE_MAX || current + 1 >= num ? 0 : current + 1;
+        } else {
+            current = current == 0 || current > num ? num - 1 : current - 1;
+        }
+        editor_row_t *erow = &editor_cfg.buf->erows[current];
+        if (skip_unrendered && memmem(erow->chars, erow->size, query, query_len) == NULL) { continue; }
+        editor_row_prepare(erow);
+        char *match = memmem(erow->render, erow->rsize, query, query_len);
         if (match != NULL) {
             last_match = current;
-            editor_cfg.cy = current;
-            editor_cfg.cx = editor_row_rx_to_cx(erow, match - erow->render);
-            editor_cfg.row_offset = editor_cfg.num_erows;
+            editor_cfg.buf->cy = current;
+            editor_cfg.buf->cx = editor_row_rx_to_cx(erow, editor_row_render_to_rx(erow, match - erow->render));
+            editor_cfg.buf->row_offset = editor_cfg.buf->num_erows;
             saved_hl_line = current;
             saved_hl = (char *)calloc(erow->rsize, sizeof(char));
             memcpy(saved_hl, erow->highlight, erow->rsize);
-            memset(&erow->highlight[match - erow->render], HL_MATCH, strlen(query));
+            memset(&erow->highlight[match - erow->render], HL_MATCH, query_len);
             break;
         }
     }
 }
 
 void editor_find() {
-    unsigned saved_cx = editor_cfg.cx;
-    unsigned saved_cy = editor_cfg.cy;
-    unsigned saved_col_offset = editor_cfg.col_offset;
-    unsigned saved_row_offset = editor_cfg.row_offset;
-    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback);
+    size_t saved_cx = editor_cfg.buf->cx;
+    size_t saved_cy = editor_cfg.buf->cy;
+    size_t saved_col_offset = editor_cfg.buf->col_offset;
+    size_t saved_row_offset = editor_cfg.buf->row_offset;
+    char *query = editor_prompt("Search: %s (Use ESC/Arrows/Enter)", editor_find_callback, false);
     if (query != NULL) { free(query); } else {
-        editor_cfg.cx = saved_cx;
-        editor_cfg.cy = saved_cy;
-        editor_cfg.col_offset = saved_col_offset;
-        editor_cfg.row_offset = saved_row_offset;
+        editor_cfg.buf->cx = saved_cx;
+        editor_cfg.buf->cy = saved_cy;
+        editor_cfg.buf->col_offset = saved_col_offset;
+        editor_cfg.buf->row_offset = saved_row_offset;
+    }
+}
+
+typedef struct {
+    editor_row_t *erows;
+    size_t from;
+    size_t to;
+    const char *query;
+    size_t query_len;
+    const char *with;
+    size_t with_len;
+    size_t *counts;
+    char **out;
+    size_t total;
+} editor_replace_job_t;
+
+/* Counts the non-overlapping matches in a row and, when out is given, writes the row
+ * with each of them replaced there */
+size_t editor_replace_row(const editor_row_t *erow, const editor_replace_job_t *job, char *out) {
+    size_t count = 0;
+    const char *pos = erow->chars;
+    const char *end = &erow->chars[erow->size];
+    const char *match = NULL;
+    while ((match = memmem(pos, end - pos, job->query, job->query_len)) != NULL) {
+        if (out != NULL) {
+            memcpy(out, pos, match - pos);
+            out += match - pos;
+            memcpy(out, job->with, job->with_len);
+            out += job->with_len;
+        }
+
+        pos = match + job->query_len;
+        count += 1;
+    }
+
+    if (out != NULL) {
+        memcpy(out, pos, end - pos);
+        out[end - pos] = '\0';
+    }
+
+    return count;
+}
+
+/* Runs one pass over a share of the rows: counting when out is NULL, rewriting the
+ * rows with matches into their preallocated output otherwise */
+void *editor_replace_worker(void *arg) {
+    editor_replace_job_t *job = arg;
+    for (size_t j = job->from; j < job->to; j++) {
+        if (job->out == NULL) {
+            job->counts[j] = editor_replace_row(&job->erows[j], job, NULL);
+            job->total += job->counts[j];
+        } else if (job->counts[j] > 0) {
+            editor_replace_row(&job->erows[j], job, job->out[j]);
+        }
+    }
+
+    return NULL;
+}
+
+void editor_replace_run(editor_replace_job_t *jobs, unsigned threads) {
+    pthread_t tids[KILO_REPLACE_THREADS];
+    bool started[KILO_REPLACE_THREADS] = {false};
+    for (unsigned t = 1; t < threads; t++) {
+        started[t] = pthread_create(&tids[t], NULL, editor_replace_worker, &jobs[t]) == 0;
+    }
+
+    editor_replace_worker(&jobs[0]);
+    for (unsigned t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(tids[t], NULL);
+        } else {
+            editor_replace_worker(&jobs[t]);
+        }
+    }
+}
+
+/* Copies rows first to last, joined by newlines, as the journal and undo log see them */
+char *editor_rows_span(size_t first, size_t last, size_t *len) {
+    *len = last - first;
+    for (size_t j = first; j <= last; j++) { *len += editor_cfg.buf->erows[j].size; }
+    char *buf = malloc(*len);
+    char *ptr = buf;
+    for (size_t j = first; j <= last; j++) {
+        if (j > first) { *ptr++ = '\n'; }
+        memcpy(ptr, editor_cfg.buf->erows[j].chars, editor_cfg.buf->erows[j].size);
+        ptr += editor_cfg.buf->erows[j].size;
+    }
+
+    return buf;
+}
+
+/* Replaces every occurrence of query. All matches are counted first so each affected
+ * row is rewritten once into a block of its final size, both passes split across
+ * threads on large buffers. Rewritten rows are left to render lazily and comment
+ * state is carried forward in one pass. The whole replace is logged as deleting and
+ * reinserting the span of affected lines, so it undoes as one step. */
+void editor_replace_all(const char *query, const char *with) {
+    size_t num = editor_cfg.buf->num_erows;
+    size_t bytes = 0;
+    for (size_t j = 0; j < num; j++) { bytes += editor_cfg.buf->erows[j].size + 1; }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = bytes < KILO_REPLACE_PARALLEL || cpus < 2 ? 1 : cpus < KILO_REPLACE_THREADS ? cpus : KILO_REPLACE_THREADS;
+    size_t *counts = calloc(num + 1, sizeof(size_t));
+    editor_replace_job_t jobs[KILO_REPLACE_THREADS];
+    size_t row = 0;
+    for (unsigned t = 0; t < threads; t++) {
+        jobs[t] = (editor_replace_job_t){editor_cfg.buf->erows, row, row, query, strlen(query), with, strlen(with), counts, NULL, 0};
+        for (size_t share = 0; row < num && (share < bytes / threads || t == threads - 1); row++) {
+            share += editor_cfg.buf->erows[row].size + 1;
+        }
+        jobs[t].to = row;
+    }
+
+    editor_replace_run(jobs, threads);
+    size_t total = 0;
+    for (unsigned t = 0; t < threads; t++) { total += jobs[t].total; }
+    if (total == 0) {
+        editor_set_status_msg("No matches for %s", query);
+        free(counts);
+        return;
+    }
+
+    size_t first = 0;
+    size_t last = num - 1;
+    while (counts[first] == 0) { first += 1; }
+    while (counts[last] == 0) { last -= 1; }
+
+    char **out = calloc(num, sizeof(char *));
+    size_t query_len = jobs[0].query_len;
+    size_t with_len = jobs[0].with_len;
+    size_t lines = 0;
+    for (size_t j = first; j <= last; j++) {
+        if (counts[j] == 0) { continue; }
+        out[j] = editor_pool_alloc(editor_cfg.buf->erows[j].size - counts[j] * query_len + counts[j] * with_len + 1);
+        lines += 1;
+    }
+
+    for (unsigned t = 0; t < threads; t++) { jobs[t].out = out; }
+    editor_replace_run(jobs, threads);
+
+    size_t span_len = 0;
+    char *span = editor_rows_span(first, last, &span_len);
+    editor_undo_boundary();
+    editor_log_edit(EDIT_DELETE_TEXT, first, 0, span, span_len);
+    free(span);
+
+    for (size_t j = first; j <= last; j++) {
+        if (counts[j] == 0) { continue; }
+        editor_row_t *erow = &editor_cfg.buf->erows[j];
+        editor_pool_free(erow->chars);
+        editor_pool_free(erow->render);
+        editor_pool_free(erow->highlight);
+        erow->size = erow->size - counts[j] * query_len + counts[j] * with_len;
+        erow->chars = out[j];
+        erow->rsize = 0;
+        erow->render = NULL;
+        erow->highlight = NULL;
+        erow->ascii = false;
+    }
+
+    span = editor_rows_span(first, last, &span_len);
+    editor_log_edit(EDIT_INSERT_TEXT, first, 0, span, span_len);
+    editor_undo_boundary();
+    free(span);
+    free(out);
+
+    bool prev_open = first > 0 && editor_cfg.buf->erows[first - 1].hl_open_comment;
+    for (size_t j = first; j < num; j++) {
+        editor_row_t *erow = &editor_cfg.buf->erows[j];
+        bool in_comment = j > 0 && editor_cfg.buf->erows[j - 1].hl_open_comment;
+        bool changed = in_comment != prev_open;
+        if (j > last && !changed) { break; }
+        prev_open = erow->hl_open_comment;
+        erow->hl_open_comment = editor_comment_state(erow->chars, erow->size, in_comment);
+        if (erow->render != NULL && changed && counts[j] == 0) {
+            editor_pool_free(erow->render);
+            editor_pool_free(erow->highlight);
+            erow->rsize = 0;
+            erow->render = NULL;
+            erow->highlight = NULL;
+            erow->ascii = false;
+        }
     }
+
+    free(counts);
+    if (editor_cfg.buf->cy < num && editor_cfg.buf->cx > editor_cfg.buf->erows[editor_cfg.buf->cy].size) {
+        editor_cfg.buf->cx = editor_cfg.buf->erows[editor_cfg.buf->cy].size;
+    }
+    editor_cfg.buf->dirty = true;
+    editor_set_status_msg("Replaced %zu occurrences on %zu lines", total, lines);
+}
+
+void editor_replace() {
+    char *query = editor_prompt("Replace: %s (ESC to cancel)", NULL, false);
+    if (query == NULL) { return; }
+    char *with = editor_prompt("Replace with: %s (ESC to cancel)", NULL, true);
+    if (with != NULL) { editor_replace_all(query, with); }
+    free(query);
+    free(with);
+}
+
+/* Moves to a 1-based line and centres it; only the rows around it get rendered */
+void editor_goto_line(unsigned long line) {
+    editor_cfg.buf->cy = line <= editor_cfg.buf->num_erows ? line - 1 : editor_cfg.buf->num_erows;
+    editor_cfg.buf->cx = 0;
+    editor_cfg.buf->row_offset = editor_cfg.buf->cy > editor_cfg.screen_rows / 2 ? editor_cfg.buf->cy - editor_cfg.screen_rows / 2 : 0;
+}
+
+void editor_goto() {
+    char *query = editor_prompt("Go to line: %s (ESC to cancel)", NULL, false);
+    if (query == NULL) { return; }
+    unsigned long line = strtoul(query, NULL, 10);
+    if (line > 0) { editor_goto_line(line); }
+    free(query);
 }
 
 unsigned editor_read_key() {
@@ -789,6 +3621,8 @@ unsigned editor_read_key() {
         if (nread == -1 && errno != EAGAIN) { die("editor_read_key :: read"); }
     }
 
+    editor_prof_key();
+
     if (c == '\x1b') {
         char seq[3] = {0};
         if (read(STDIN_FILENO, &seq[0], 1) != 1) { return '\x1b'; }
@@ -824,10 +3658,11 @@ unsigned editor_read_key() {
             }
         }
         return '\x1b';
-    } else { return c; }
+    } else { return (unsigned char)c; }
 }
 
-char *editor_prompt(char *prompt, void (*callback)(char *, unsigned)) {
+/* Reads a line in the message bar; Enter on an empty line is ignored unless allow_empty */
+char *editor_prompt(char *prompt, void (*callback)(char *, unsigned), bool allow_empty) {
     size_t bufsize = 128;
     char *buf = (char *)calloc(bufsize, sizeof(char));
     size_t buflen = 0;
@@ -837,19 +3672,21 @@ char *editor_prompt(char *prompt, void (*callback)(char *, unsigned)) {
         editor_refresh_screen();
         unsigned chr = editor_read_key();
         if (chr == DEL_KEY || chr == (CTRL_KEY('h')) || chr == BACKSPACE) {
-            if (buflen != 0) { buf[--buflen] = '\0'; }
+            while (buflen != 0 && utf8_is_continuation(buf[buflen - 1])) { buflen -= 1; }
+            if (buflen != 0) { buflen -= 1; }
+            buf[buflen] = '\0';
         } else if (chr == '\x1b') {
-            editor_set_status_msg("");
+            editor_set_status_msg("%s", "");
             if (callback != NULL) { callback(buf, chr); }
             free(buf);
             return NULL;
         } else if (chr == '\r') {
-            if (buflen != 0) {
-                editor_set_status_msg("");
+            if (buflen != 0 || allow_empty) {
+                editor_set_status_msg("%s", "");
                 if (callback != NULL) { callback(buf, chr); }
                 return buf;
             }
-        } else if (!iscntrl(chr) && chr < 128) {
+        } else if (chr < 256 && !iscntrl(chr)) {
             if (buflen == bufsize - 1) {
                 bufsize *= 2;
                 buf = (char *)realloc(buf, bufsize);
@@ -864,51 +3701,61 @@ char *editor_prompt(char *prompt, void (*callback)(char *, unsigned)) {
 }
 
 void editor_move_cursor(unsigned key) {
-    editor_row_t *erow = (editor_cfg.cy >= editor_cfg.num_erows) ? NULL : &editor_cfg.erows[editor_cfg.cy];
+    editor_row_t *erow = (editor_cfg.buf->cy >= editor_cfg.buf->num_erows) ? NULL : &editor_cfg.buf->erows[editor_cfg.buf->cy];
     switch (key) {
         case ARROW_LEFT:
-            if (editor_cfg.cx != 0) {
-                editor_cfg.cx -= 1;
-            } else if (editor_cfg.cy > 0) {
-                editor_cfg.cy -= 1;
-                editor_cfg.cx = editor_cfg.erows[editor_cfg.cy].size;
+            if (editor_cfg.buf->cx != 0) {
+                editor_cfg.buf->cx = editor_row_prev_cx(erow, editor_cfg.buf->cx);
+            } else if (editor_cfg.buf->cy > 0) {
+                editor_cfg.buf->cy -= 1;
+                editor_cfg.buf->cx = editor_cfg.buf->erows[editor_cfg.buf->cy].size;
             }
             break;
         case ARROW_RIGHT:
-            if (erow != NULL && editor_cfg.cx < erow->size) {
-                editor_cfg.cx += 1;
-            } else if (erow != NULL && editor_cfg.cx == erow->size) {
-                editor_cfg.cy += 1;
-                editor_cfg.cx = 0;
+            if (erow != NULL && editor_cfg.buf->cx < erow->size) {
+                editor_cfg.buf->cx = editor_row_next_cx(erow, editor_cfg.buf->cx);
+            } else if (erow != NULL && editor_cfg.buf->cx == erow->size) {
+                editor_cfg.buf->cy += 1;
+                editor_cfg.buf->cx = 0;
             }
             break;
         case ARROW_UP:
-            if (editor_cfg.cy != 0) { editor_cfg.cy -= 1; }
+            if (editor_cfg.buf->cy != 0) { editor_cfg.buf->cy -= 1; }
             break;
         case ARROW_DOWN:
-            if (editor_cfg.cy < editor_cfg.num_erows) { editor_cfg.cy += 1; }
+            if (editor_cfg.buf->cy < editor_cfg.buf->num_erows) { editor_cfg.buf->cy += 1; }
             break;
     }
 
-    erow = (editor_cfg.cy >= editor_cfg.num_erows) ? NULL : &editor_cfg.erows[editor_cfg.cy];
-    unsigned row_len = erow != NULL ? erow->size : 0;
-    if (editor_cfg.cx > row_len) { editor_cfg.cx = row_len; }
+    erow = (editor_cfg.buf->cy >= editor_cfg.buf->num_erows) ? NULL : &editor_cfg.buf->erows[editor_cfg.buf->cy];
+    size_t row_len = erow != NULL ? erow->size : 0;
+    if (editor_cfg.buf->cx > row_len) { editor_cfg.buf->cx = row_len; }
+    while (editor_cfg.buf->cx > 0 && editor_cfg.buf->cx < row_len && utf8_is_continuation(erow->chars[editor_cfg.buf->cx])) {
+        editor_cfg.buf->cx -= 1;
+    }
 }
 
 void editor_process_keypress() {
     static unsigned short quit_times = KILO_QUIT_TIMES;
     unsigned c = editor_read_key();
+    ALLOC_ENTER(editor_alloc_key_op(c));
+    if (c != '\r' && c != '\t' && (c > 255 || iscntrl(c))) { editor_undo_boundary(); }
 
     switch (c) {
         case '\r':
             editor_insert_newline();
             break;
         case CTRL_KEY('q'):
-            if (editor_cfg.dirty && quit_times > 0) {
+            if (editor_buffers_dirty() && quit_times > 0) {
                 editor_set_status_msg("WARNING!!! File has unsaved changes. Press Ctrl-Q " "%u more times to quit.", quit_times);
                 quit_times -= 1;
+                ALLOC_LEAVE();
                 return;
             }
+            for (unsigned j = 0; j < editor_cfg.num_buffers; j++) {
+                editor_cfg.buf = editor_cfg.buffers[j];
+                editor_journal_discard();
+            }
             write(STDOUT_FILENO, "\x1b[2J", 4);
             write(STDOUT_FILENO, "\x1b[H", 3);
             exit(0);
@@ -917,14 +3764,60 @@ void editor_process_keypress() {
             editor_save();
             break;
         case HOME_KEY:
-            editor_cfg.cx = 0;
+            editor_cfg.buf->cx = 0;
             break;
         case END_KEY:
-            if (editor_cfg.cy < editor_cfg.num_erows) { editor_cfg.cx = editor_cfg.erows[editor_cfg.cy].size; }
+            if (editor_cfg.buf->cy < editor_cfg.buf->num_erows) { editor_cfg.buf->cx = editor_cfg.buf->erows[editor_cfg.buf->cy].size; }
             break;
         case CTRL_KEY('f'):
             editor_find();
             break;
+        case CTRL_KEY('r'):
+            editor_replace();
+            break;
+        case CTRL_KEY('t'):
+            if (editor_cfg.buf->follow.enabled) {
+                editor_follow_stop();
+            } else {
+                editor_follow_start();
+                if (editor_cfg.buf->follow.enabled) { editor_follow_update(); }
+            }
+            editor_set_status_msg("Follow %s", editor_cfg.buf->follow.enabled ? "on" : "off");
+            break;
+        case CTRL_KEY('g'):
+            editor_goto();
+            break;
+        case CTRL_KEY('o'): {
+            char *filename = editor_prompt("Open: %s (ESC to cancel)", NULL, false);
+            if (filename != NULL) { editor_buffer_open(filename); }
+            free(filename);
+            break;
+        }
+        case CTRL_KEY('n'):
+            editor_buffer_switch((editor_buffer_index() + 1) % editor_cfg.num_buffers);
+            break;
+        case CTRL_KEY('b'):
+            editor_buffer_pick();
+            break;
+        case CTRL_KEY('w'):
+            if (editor_cfg.buf->dirty && quit_times > 0) {
+                editor_set_status_msg("WARNING!!! Buffer has unsaved changes. Press Ctrl-W " "%u more times to close it.", quit_times);
+                quit_times -= 1;
+                ALLOC_LEAVE();
+                return;
+            }
+            editor_buffer_close();
+            break;
+        case CTRL_KEY('z'):
+            editor_undo();
+            break;
+        case CTRL_KEY('y'):
+            editor_redo();
+            break;
+        case CTRL_KEY('p'):
+            editor_prof_enable(!editor_prof.enabled);
+            editor_set_status_msg("Profiling %s", editor_prof.enabled ? "enabled" : "disabled");
+            break;
         case DEL_KEY:
             editor_move_cursor(ARROW_RIGHT); // fallthrough
         case BACKSPACE:
@@ -934,11 +3827,11 @@ void editor_process_keypress() {
         case PAGE_UP:
         case PAGE_DOWN: {
             if (c == PAGE_UP) {
-                editor_cfg.cy = editor_cfg.row_offset;
+                editor_cfg.buf->cy = editor_cfg.buf->row_offset;
             } else if (c == PAGE_DOWN) {
-                editor_cfg.cy = editor_cfg.row_offset + editor_cfg.screen_rows - 1;
-                if (editor_cfg.cy > editor_cfg.num_erows) {
-                    editor_cfg.cy = editor_cfg.num_erows;
+                editor_cfg.buf->cy = editor_cfg.buf->row_offset + editor_cfg.screen_rows - 1;
+                if (editor_cfg.buf->cy > editor_cfg.buf->num_erows) {
+                    editor_cfg.buf->cy = editor_cfg.buf->num_erows;
                 }
             }
 
@@ -952,6 +3845,12 @@ void editor_process_keypress() {
         case ARROW_RIGHT:
             editor_move_cursor(c);
             break;
+#ifdef KILO_ALLOC_TRACK
+        case CTRL_KEY('a'):
+            editor_alloc.live_view = !editor_alloc.live_view;
+            editor_set_status_msg("Allocation view %s", editor_alloc.live_view ? "on" : "off");
+            break;
+#endif
         case CTRL_KEY('l'):
         case '\x1b':
             break;
@@ -961,39 +3860,152 @@ void editor_process_keypress() {
     }
 
     quit_times = KILO_QUIT_TIMES;
+    ALLOC_LEAVE();
+#ifdef KILO_ALLOC_TRACK
+    if (editor_alloc.live_view && c != CTRL_KEY('a')) {
+        char buf[80] = {0};
+        editor_alloc_format(buf, sizeof(buf), editor_alloc_key_op(c));
+        editor_set_status_msg("%s", buf);
+    }
+#endif
 }
 
-void editor_init() {
-    editor_cfg.cx = 0;
-    editor_cfg.cy = 0;
-    editor_cfg.rx = 0;
-    editor_cfg.row_offset = 0;
-    editor_cfg.col_offset = 0;
-    editor_cfg.num_erows = 0;
-    editor_cfg.erows = NULL;
-    editor_cfg.dirty = false;
-    editor_cfg.filename = NULL;
+bool editor_input_pending() {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Processes keys until no more input is queued or the next frame is due */
+void editor_drain_input() {
+    do {
+        editor_process_keypress();
+        if (editor_prof.enabled) {
+            prof_record(PROF_KEYPRESS, prof_now() - editor_prof.last_key_time);
+        }
+
+        editor_pacer.pending = true;
+    } while (editor_input_pending() && prof_now() < editor_pacer.next_frame);
+}
+
+void editor_render_if_due() {
+    if (!editor_pacer.pending) { return; }
+    uint64_t now = prof_now();
+    if (now < editor_pacer.next_frame) { return; }
+    editor_refresh_screen();
+    editor_pacer.next_frame = now + editor_pacer.interval_ns;
+}
+
+int editor_pacer_timeout_ms() {
+    if (!editor_pacer.pending) { return -1; }
+    uint64_t now = prof_now();
+    if (now >= editor_pacer.next_frame) { return 0; }
+    return (editor_pacer.next_frame - now + 999999) / 1000000;
+}
+
+void editor_init_with_size(unsigned rows, unsigned cols) {
     editor_cfg.status_msg_time = 0;
     memset(editor_cfg.status_msg, 0, sizeof(editor_cfg.status_msg));
-    editor_cfg.syntax = NULL;
+    editor_cfg.sync_output = false;
+    editor_cfg.edit_nesting = 0;
+    if (editor_cfg.num_buffers == 0) { editor_buffer_new(); }
+    editor_cfg.screen_rows = rows - 2;
+    editor_cfg.screen_cols = cols;
+}
+
+void editor_init() {
+    unsigned rows = 0;
+    unsigned cols = 0;
+    if (get_window_size(&rows, &cols) == -1) { die("init_editor :: get_window_size"); }
+    editor_init_with_size(rows, cols);
+    editor_cfg.sync_output = get_sync_output_support();
+}
+
+/* Compiles .syn definitions into a bundle at out, replacing it atomically */
+int editor_build_syntax(const char *out, int count, char **paths) {
+    syntax_def_t *defs = calloc(count, sizeof(syntax_def_t));
+    bool ok = true;
+    for (int j = 0; ok && j < count; j++) {
+        FILE *fp = fopen(paths[j], "r");
+        if (fp == NULL) {
+            fprintf(stderr, "%s: %s\n", paths[j], strerror(errno));
+            ok = false;
+            break;
+        }
+
+        abuf text = ABUF_INIT;
+        char chunk[4096];
+        size_t n = 0;
+        while ((n = fread(chunk, 1, sizeof(chunk), fp)) > 0) { abuf_append(&text, chunk, n); }
+        fclose(fp);
+        ok = editor_syntax_parse(&defs[j], text.data, text.len, paths[j]);
+        abuf_free(&text);
+    }
 
-    if (get_window_size(&editor_cfg.screen_rows, &editor_cfg.screen_cols) == -1) {
-        die("init_editor :: get_window_size");
+    abuf bundle = ABUF_INIT;
+    char tmp[PATH_MAX] = {0};
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    if (ok) {
+        editor_syntax_build(&bundle, defs, count);
+        int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        ok = fd != -1 && editor_write_all(fd, bundle.data, bundle.len) && fsync(fd) == 0;
+        if (fd != -1) { close(fd); }
+        ok = ok && rename(tmp, out) == 0;
+        if (!ok) {
+            fprintf(stderr, "%s: %s\n", out, strerror(errno));
+            unlink(tmp);
+        }
     }
 
-    editor_cfg.screen_rows -= 2;
+    if (ok) { printf("%s: %d languages, %zu bytes\n", out, count, bundle.len); }
+    for (int j = 0; j < count; j++) { editor_syntax_def_free(&defs[j]); }
+    free(defs);
+    abuf_free(&bundle);
+    return ok ? 0 : 1;
 }
 
+#ifndef KILO_BENCH
 int main(int argc, char *argv[]) {
+    if (argc >= 3 && strcmp(argv[1], "--build-syntax") == 0) { return editor_build_syntax(argv[2], argc - 3, &argv[3]); }
     enable_raw_mode();
     editor_init();
-    if (argc >= 2) { editor_open(argv[1]); }
+    editor_prof_init();
+#ifdef KILO_ALLOC_TRACK
+    atexit(editor_alloc_dump);
+#endif
     editor_set_status_msg("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    bool follow = false;
+    unsigned long line = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            follow = true;
+        } else if (argv[i][0] == '+') {
+            line = strtoul(&argv[i][1], NULL, 10);
+        } else {
+            editor_buffer_open(argv[i]);
+            if (follow) { editor_follow_start(); }
+            if (line > 0) { editor_goto_line(line); }
+            line = 0;
+        }
+    }
+
+    editor_buffer_switch(0);
+    atexit(editor_journal_flush);
 
     while (1) {
-        editor_refresh_screen();
-        editor_process_keypress();
+        editor_render_if_due();
+        struct pollfd pfds[2] = {{STDIN_FILENO, POLLIN, 0}, {editor_cfg.buf->follow.fd, POLLIN, 0}};
+        int ready = poll(pfds, editor_cfg.buf->follow.enabled ? 2 : 1,
+                         editor_journal_timeout_ms(editor_follow_timeout_ms(editor_pacer_timeout_ms())));
+        if (ready > 0 && (pfds[0].revents & POLLIN)) { editor_drain_input(); }
+        if (editor_cfg.buf->follow.enabled &&
+            ((pfds[1].revents & POLLIN) || (ready == 0 && editor_cfg.buf->follow.watch == -1))) {
+            editor_follow_update();
+            editor_pacer.pending = true;
+        }
+
+        editor_journal_tick();
     }
 
     return 0;
 }
+#endif